@@ -4,41 +4,2152 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <set>
+#include <memory>
 #include <filesystem>
 #include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <unordered_map>
 #include <thread>
+#include <future>
+#include <queue>
+#include <functional>
 #include <algorithm>
+#include <string_view>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <array>
+#include <cmath>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define CSV_SIMD_SSE2
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include "ConsoleApplication9/ResultSink.h"
+#include "ConsoleApplication9/BPlusTree.h"
 #include "nlohmann/json.hpp" // Подключите библиотеку JSON (nlohmann/json.hpp)
 
 namespace fs = std::filesystem;
 using json = nlohmann::json;
 
+// Формат файлов сегментов: текстовый CSV (N.csv), двоичный по строкам (N.bin)
+// или колоночный (файл на каждый столбец, N_pk.col и N_<номер поля>.col)
+enum class SegmentFormat {
+    Csv,
+    Binary,
+    Columnar
+};
+
 // Структура для хранения схемы данных
 struct Schema {
     std::string name;
     int tuples_limit;
+    double compaction_threshold = 0.3; // доля удалённых строк, после которой сегмент сжимается
+    SegmentFormat format = SegmentFormat::Csv; // формат сегментов новых таблиц
     std::map<std::string, std::vector<std::string>> structure;
+    std::map<std::string, std::vector<std::string>> bloomFilters; // таблица -> столбцы с фильтрами Блума
+};
+
+// Хеш, не зависящий от реализации стандартной библиотеки: скетчи сохраняются на диск
+// (FNV-1a и перемешивание splitmix64)
+inline uint64_t stableHash(std::string_view value) {
+    uint64_t hash = 14695981039346656037ull;
+    for (char c : value) {
+        hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+    }
+    hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ull;
+    hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebull;
+    return hash ^ (hash >> 31);
+}
+
+// Сводка по значениям одного поля сегмента: границы в порядке IndexKey и скетч
+// HyperLogLog на 64 регистра для оценки числа различных значений
+struct ColumnStats {
+    bool hasValues = false;
+    IndexKey min;
+    IndexKey max;
+    std::array<uint8_t, 64> registers{};
+
+    void add(std::string_view value) {
+        IndexKey key = IndexKey::from(value);
+        if (!hasValues || key < min) {
+            min = key;
+        }
+        if (!hasValues || max < key) {
+            max = key;
+        }
+        hasValues = true;
+
+        uint64_t hash = stableHash(value);
+        size_t index = static_cast<size_t>(hash >> 58);
+        uint64_t rest = hash << 6;
+        uint8_t rank = 1;
+        while (rank <= 58 && (rest & (1ull << 63)) == 0) {
+            rest <<= 1;
+            ++rank;
+        }
+        registers[index] = std::max(registers[index], rank);
+    }
+
+    // Скетч объединения значений: HyperLogLog объединяется поэлементным максимумом регистров
+    void merge(const ColumnStats& other) {
+        for (size_t i = 0; i < registers.size(); ++i) {
+            registers[i] = std::max(registers[i], other.registers[i]);
+        }
+    }
+
+    double distinctEstimate() const {
+        double m = static_cast<double>(registers.size());
+        double sum = 0;
+        int zeros = 0;
+        for (uint8_t rank : registers) {
+            sum += std::ldexp(1.0, -rank);
+            zeros += rank == 0 ? 1 : 0;
+        }
+        double estimate = 0.709 * m * m / sum;
+        if (estimate <= 2.5 * m && zeros > 0) {
+            estimate = m * std::log(m / zeros); // поправка для малого числа значений
+        }
+        return estimate;
+    }
+};
+
+// Сводка сегмента (zone map): по ColumnStats на поле, поле 0 — первичный ключ. Пустой
+// columns означает, что сводка не построена и сегмент отсеивать по ней нельзя.
+struct SegmentStats {
+    std::vector<ColumnStats> columns;
+
+    void addRow(int pk, const std::vector<std::string>& values) {
+        columns[0].add(std::to_string(pk));
+        for (size_t i = 0; i < values.size() && i + 1 < columns.size(); ++i) {
+            columns[i + 1].add(values[i]);
+        }
+    }
+};
+
+// Фильтр Блума по значениям одного поля сегмента: ложноотрицательных ответов нет,
+// ложноположительных около 1% при 10 битах на строку и 7 хешах
+class BloomFilter {
+public:
+    BloomFilter() = default;
+
+    explicit BloomFilter(size_t expectedRows) : bits((std::max<size_t>(expectedRows, 1) * bitsPerRow + 63) / 64) {
+    }
+
+    void add(std::string_view value) {
+        uint64_t hash = stableHash(value);
+        uint64_t step = (hash * 0x9e3779b97f4a7c15ull) | 1;
+        uint64_t size = bits.size() * 64;
+        for (int i = 0; i < hashCount; ++i, hash += step) {
+            uint64_t bit = hash % size;
+            bits[bit / 64] |= 1ull << (bit % 64);
+        }
+    }
+
+    bool mayContain(std::string_view value) const {
+        uint64_t hash = stableHash(value);
+        uint64_t step = (hash * 0x9e3779b97f4a7c15ull) | 1;
+        uint64_t size = bits.size() * 64;
+        for (int i = 0; i < hashCount; ++i, hash += step) {
+            uint64_t bit = hash % size;
+            if ((bits[bit / 64] & (1ull << (bit % 64))) == 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Файл фильтра: [u32 bloomMagic][u32 число слов] и слова по 64 бита
+    std::string serialize() const {
+        std::string data;
+        data.append(reinterpret_cast<const char*>(&bloomMagic), sizeof(bloomMagic));
+        uint32_t words = static_cast<uint32_t>(bits.size());
+        data.append(reinterpret_cast<const char*>(&words), sizeof(words));
+        data.append(reinterpret_cast<const char*>(bits.data()), bits.size() * sizeof(uint64_t));
+        return data;
+    }
+
+    // false, если файл повреждён или не является фильтром
+    bool deserialize(std::string_view data) {
+        uint32_t magic = 0;
+        uint32_t words = 0;
+        if (data.size() < 8) {
+            return false;
+        }
+        std::memcpy(&magic, data.data(), sizeof(magic));
+        std::memcpy(&words, data.data() + 4, sizeof(words));
+        if (magic != bloomMagic || words == 0 || data.size() != 8 + words * sizeof(uint64_t)) {
+            return false;
+        }
+        bits.resize(words);
+        std::memcpy(bits.data(), data.data() + 8, words * sizeof(uint64_t));
+        return true;
+    }
+
+private:
+    static constexpr uint32_t bloomMagic = 0x4c424753; // "SGBL"
+    static constexpr size_t bitsPerRow = 10;
+    static constexpr int hashCount = 7;
+    std::vector<uint64_t> bits;
+};
+
+inline json statsToJson(const SegmentStats& stats) {
+    json columns = json::array();
+    for (const ColumnStats& column : stats.columns) {
+        if (!column.hasValues) {
+            columns.push_back(nullptr);
+            continue;
+        }
+        std::string sketch;
+        for (uint8_t rank : column.registers) {
+            sketch.push_back("0123456789abcdef"[rank >> 4]);
+            sketch.push_back("0123456789abcdef"[rank & 15]);
+        }
+        columns.push_back({ {"min", column.min.toString()}, {"max", column.max.toString()}, {"sketch", sketch} });
+    }
+    return columns;
+}
+
+inline SegmentStats statsFromJson(const json& columns) {
+    SegmentStats stats;
+    for (const auto& entry : columns) {
+        ColumnStats& column = stats.columns.emplace_back();
+        if (entry.is_null()) {
+            continue;
+        }
+        column.hasValues = true;
+        column.min = IndexKey::from(entry["min"].get<std::string>());
+        column.max = IndexKey::from(entry["max"].get<std::string>());
+        std::string sketch = entry["sketch"];
+        for (size_t i = 0; i < column.registers.size() && 2 * i + 1 < sketch.size(); ++i) {
+            column.registers[i] = static_cast<uint8_t>(std::stoi(sketch.substr(2 * i, 2), nullptr, 16));
+        }
+    }
+    return stats;
+}
+
+// Сегмент таблицы (файл N.csv, N.bin или файлы N_*.col) и его размеры. rows учитывает и строки, помеченные
+// удалёнными (deadRows), пока сегмент не сжат.
+struct SegmentInfo {
+    int id;
+    int rows;
+    std::uintmax_t bytes;
+    int deadRows = 0;
+    bool sealed = false; // двоичный сегмент завершён подвалом, дописывать в него нельзя
+    SegmentStats stats{}; // учитывает и удалённые строки
+    std::map<int, BloomFilter> blooms{}; // номер поля -> фильтр Блума (столбцы из bloom_filters схемы)
+};
+
+// Положение строки в таблице: сегмент и смещение строки от начала его файла
+struct RowLocation {
+    int segmentId;
+    std::uintmax_t offset;
+};
+
+// Диапазон первичных ключей, зарезервированный процессом: [next, limit)
+struct PkRange {
+    int next = 0;
+    int limit = 0;
+};
+
+// Операция сравнения в условии WHERE. Равенство сравнивает строки как есть, остальные
+// операции — по IndexKey, то есть числа как числа.
+enum class CompareOp {
+    Equal,
+    Less,
+    LessEqual,
+    Greater,
+    GreaterEqual
+};
+
+// Условие запроса до разрешения столбца: столбец <op> значение
+struct Condition {
+    std::string column;
+    CompareOp op;
+    std::string value;
+};
+
+// Условие отбора с уже найденным номером поля в строке сегмента
+struct Predicate {
+    int column;
+    std::string value;
+    bool (*matches)(std::string_view field, std::string_view value);
+    CompareOp op = CompareOp::Equal;
+};
+
+inline bool fieldEquals(std::string_view field, std::string_view value) {
+    return field == value;
+}
+
+inline bool fieldLess(std::string_view field, std::string_view value) {
+    return IndexKey::from(field) < IndexKey::from(value);
+}
+
+inline bool fieldLessEqual(std::string_view field, std::string_view value) {
+    return !(IndexKey::from(value) < IndexKey::from(field));
+}
+
+inline bool fieldGreater(std::string_view field, std::string_view value) {
+    return IndexKey::from(value) < IndexKey::from(field);
+}
+
+inline bool fieldGreaterEqual(std::string_view field, std::string_view value) {
+    return !(IndexKey::from(field) < IndexKey::from(value));
+}
+
+inline auto fieldMatcher(CompareOp op) -> bool (*)(std::string_view, std::string_view) {
+    switch (op) {
+    case CompareOp::Less:
+        return fieldLess;
+    case CompareOp::LessEqual:
+        return fieldLessEqual;
+    case CompareOp::Greater:
+        return fieldGreater;
+    case CompareOp::GreaterEqual:
+        return fieldGreaterEqual;
+    default:
+        return fieldEquals;
+    }
+}
+
+// Скомпилированный запрос SELECT: столбцы условий разрешены в номера полей заранее,
+// поэтому при сканировании не выполняется ни одного поиска по схеме.
+// Условие на несуществующий столбец делает результат пустым (neverMatches).
+struct QueryPlan {
+    std::string tableName;
+    std::vector<Predicate> predicates;
+    bool neverMatches = false;
+    int orderColumn = -1; // ORDER BY: номер поля или -1
+    bool descending = false;
+};
+
+// Режим сканирования таблицы в select: последовательно или сегменты параллельно в пуле
+// потоков, с выводом в порядке сегментов (Parallel) или по мере готовности (ParallelUnordered)
+enum class ScanMode {
+    Sequential,
+    Parallel,
+    ParallelUnordered
+};
+
+// Манифест таблицы: список сегментов по порядку, последний из них — открытый (хвостовой).
+// Формат сегментов фиксируется при создании таблицы.
+struct TableManifest {
+    SegmentFormat format = SegmentFormat::Csv;
+    std::vector<SegmentInfo> segments;
+};
+
+inline std::string formatName(SegmentFormat format) {
+    switch (format) {
+    case SegmentFormat::Binary:
+        return "binary";
+    case SegmentFormat::Columnar:
+        return "columnar";
+    default:
+        return "csv";
+    }
+}
+
+inline SegmentFormat parseSegmentFormat(const std::string& name) {
+    if (name == "csv") {
+        return SegmentFormat::Csv;
+    }
+    if (name == "binary") {
+        return SegmentFormat::Binary;
+    }
+    if (name == "columnar") {
+        return SegmentFormat::Columnar;
+    }
+    throw std::runtime_error("Unknown segment format: " + name);
+}
+
+// Сбрасывает содержимое файла на диск (fsync / FlushFileBuffers); false, если не удалось
+inline bool syncFile(const std::string& fileName) {
+#ifdef _WIN32
+    HANDLE file = CreateFileA(fileName.c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr,
+        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    bool synced = FlushFileBuffers(file) != 0;
+    CloseHandle(file);
+    return synced;
+#else
+    int fd = open(fileName.c_str(), O_RDONLY);
+    if (fd == -1) {
+        return false;
+    }
+    bool synced = fsync(fd) == 0;
+    close(fd);
+    return synced;
+#endif
+}
+
+// Файл, отображённый в память только для чтения. Сканирование сегментов работает
+// прямо по его содержимому через std::string_view, без копирования строк.
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& fileName) {
+#ifdef _WIN32
+        file = CreateFileA(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr,
+            OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (file == INVALID_HANDLE_VALUE) {
+            throw std::runtime_error("Could not open file: " + fileName);
+        }
+        LARGE_INTEGER fileSize;
+        GetFileSizeEx(file, &fileSize);
+        size = static_cast<size_t>(fileSize.QuadPart);
+        if (size > 0) {
+            mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            if (mapping == nullptr) {
+                CloseHandle(file);
+                throw std::runtime_error("Could not map file: " + fileName);
+            }
+            data = static_cast<const char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+        }
+#else
+        fd = open(fileName.c_str(), O_RDONLY);
+        if (fd == -1) {
+            throw std::runtime_error("Could not open file: " + fileName);
+        }
+        struct stat st;
+        fstat(fd, &st);
+        size = static_cast<size_t>(st.st_size);
+        if (size > 0) {
+            void* address = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (address == MAP_FAILED) {
+                close(fd);
+                throw std::runtime_error("Could not map file: " + fileName);
+            }
+            madvise(address, size, MADV_SEQUENTIAL);
+            data = static_cast<const char*>(address);
+        }
+#endif
+    }
+
+    ~MappedFile() {
+#ifdef _WIN32
+        if (data != nullptr) {
+            UnmapViewOfFile(data);
+        }
+        if (mapping != nullptr) {
+            CloseHandle(mapping);
+        }
+        CloseHandle(file);
+#else
+        if (data != nullptr) {
+            munmap(const_cast<char*>(data), size);
+        }
+        close(fd);
+#endif
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    std::string_view view() const {
+        return data == nullptr ? std::string_view() : std::string_view(data, size);
+    }
+
+private:
+    const char* data = nullptr;
+    size_t size = 0;
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#else
+    int fd = -1;
+#endif
+};
+
+inline int countTrailingZeros(uint32_t mask) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return static_cast<int>(index);
+#else
+    return __builtin_ctz(mask);
+#endif
+}
+
+// Разбор блока CSV целиком: границы всех полей и строк за один проход.
+// Разделители ищутся векторно (AVX2 или SSE2, иначе побайтно), "\r\n" и пустые строки
+// обрабатываются здесь же, так что вызывающему коду остаются только смещения.
+struct CsvBlock {
+    std::vector<size_t> fieldStarts;
+    std::vector<size_t> fieldEnds;
+    std::vector<size_t> lineEnds; // индекс поля, следующего за последним полем строки
+
+    void tokenize(std::string_view data) {
+        fieldStarts.clear();
+        fieldEnds.clear();
+        lineEnds.clear();
+        fieldStart = 0;
+
+        const char* ptr = data.data();
+        size_t size = data.size();
+        size_t pos = 0;
+#if defined(__AVX2__)
+        const __m256i commas = _mm256_set1_epi8(',');
+        const __m256i newlines = _mm256_set1_epi8('\n');
+        for (; pos + 32 <= size; pos += 32) {
+            __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(ptr + pos));
+            uint32_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(
+                _mm256_or_si256(_mm256_cmpeq_epi8(chunk, commas), _mm256_cmpeq_epi8(chunk, newlines))));
+            while (mask != 0) {
+                onDelimiter(data, pos + countTrailingZeros(mask));
+                mask &= mask - 1;
+            }
+        }
+#elif defined(CSV_SIMD_SSE2)
+        const __m128i commas = _mm_set1_epi8(',');
+        const __m128i newlines = _mm_set1_epi8('\n');
+        for (; pos + 16 <= size; pos += 16) {
+            __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ptr + pos));
+            uint32_t mask = static_cast<uint32_t>(_mm_movemask_epi8(
+                _mm_or_si128(_mm_cmpeq_epi8(chunk, commas), _mm_cmpeq_epi8(chunk, newlines))));
+            while (mask != 0) {
+                onDelimiter(data, pos + countTrailingZeros(mask));
+                mask &= mask - 1;
+            }
+        }
+#endif
+        for (; pos < size; ++pos) {
+            if (ptr[pos] == ',' || ptr[pos] == '\n') {
+                onDelimiter(data, pos);
+            }
+        }
+        size_t pendingFields = fieldEnds.size() - (lineEnds.empty() ? 0 : lineEnds.back());
+        if (fieldStart < size || pendingFields > 0) {
+            onDelimiter(data, size); // последняя строка без перевода строки
+        }
+    }
+
+    size_t lineCount() const {
+        return lineEnds.size();
+    }
+
+    size_t fieldCount(size_t line) const {
+        return lineEnds[line] - firstField(line);
+    }
+
+    std::string_view field(std::string_view data, size_t line, size_t index) const {
+        size_t i = firstField(line) + index;
+        return data.substr(fieldStarts[i], fieldEnds[i] - fieldStarts[i]);
+    }
+
+    std::string_view line(std::string_view data, size_t line) const {
+        size_t begin = fieldStarts[firstField(line)];
+        return data.substr(begin, fieldEnds[lineEnds[line] - 1] - begin);
+    }
+
+private:
+    size_t fieldStart = 0;
+
+    size_t firstField(size_t line) const {
+        return line == 0 ? 0 : lineEnds[line - 1];
+    }
+
+    void onDelimiter(std::string_view data, size_t pos) {
+        bool endOfLine = pos == data.size() || data[pos] == '\n';
+        size_t end = pos;
+        if (endOfLine && end > fieldStart && data[end - 1] == '\r') {
+            --end;
+        }
+        fieldStarts.push_back(fieldStart);
+        fieldEnds.push_back(end);
+        fieldStart = pos + 1;
+
+        if (endOfLine) {
+            size_t first = lineEnds.empty() ? 0 : lineEnds.back();
+            if (fieldEnds.size() - first == 1 && end == fieldStarts.back()) {
+                fieldStarts.pop_back(); // пустая строка
+                fieldEnds.pop_back();
+            } else {
+                lineEnds.push_back(fieldEnds.size());
+            }
+        }
+    }
+};
+
+// Двоичный сегмент: заголовок [u32 binarySegmentMagic][u32 версия], затем записи
+// [u32 длина остатка записи][i32 pk][u32 число полей]([u32 длина][байты])...
+// Поле 0 хранит pk ещё и текстом, чтобы все поля читались прямо из файла без копирования.
+// Запечатанный сегмент завершается подвалом [u64 смещение записи]...[u32 число записей][u32 binaryFooterMagic].
+constexpr uint32_t binarySegmentMagic = 0x31424753; // "SGB1"
+constexpr uint32_t binaryFooterMagic = 0x46424753; // "SGBF"
+constexpr uint32_t binarySegmentVersion = 1;
+constexpr size_t binaryHeaderSize = 8;
+
+// Колоночный сегмент: файл на каждый столбец N_<номер поля>.col со значениями, каждое
+// завершено '\n', и каталог строк N_pk.col: заголовок [u32 columnarSegmentMagic][u32 число столбцов],
+// затем записи фиксированной длины [i32 pk][u32 число полей]([u64 смещение значения в файле столбца])...
+constexpr uint32_t columnarSegmentMagic = 0x31434753; // "SGC1"
+constexpr size_t columnarHeaderSize = 8;
+
+template <typename T>
+void appendBinary(std::string& out, T value) {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+template <typename T>
+T readBinary(std::string_view data, size_t offset) {
+    T value;
+    std::memcpy(&value, data.data() + offset, sizeof(value));
+    return value;
+}
+
+inline std::string segmentExtension(SegmentFormat format) {
+    switch (format) {
+    case SegmentFormat::Binary:
+        return ".bin";
+    case SegmentFormat::Columnar:
+        return "_pk.col";
+    default:
+        return ".csv";
+    }
+}
+
+// Файл столбца колоночного сегмента по имени его каталога строк (N_pk.col -> N_<field>.col)
+inline std::string columnFile(const std::string& segmentFile, size_t field) {
+    return segmentFile.substr(0, segmentFile.size() - segmentExtension(SegmentFormat::Columnar).size())
+        + "_" + std::to_string(field) + ".col";
+}
+
+// Все файлы сегмента; у колоночного каталог строк идёт последним
+inline std::vector<std::string> segmentFiles(const std::string& segmentFile, SegmentFormat format, size_t columnCount) {
+    std::vector<std::string> files;
+    if (format == SegmentFormat::Columnar) {
+        for (size_t field = 1; field <= columnCount; ++field) {
+            files.push_back(columnFile(segmentFile, field));
+        }
+    }
+    files.push_back(segmentFile);
+    return files;
+}
+
+inline std::string binarySegmentFooter(const std::vector<uint64_t>& offsets) {
+    std::string footer;
+    for (uint64_t offset : offsets) {
+        appendBinary(footer, offset);
+    }
+    appendBinary(footer, static_cast<uint32_t>(offsets.size()));
+    appendBinary(footer, binaryFooterMagic);
+    return footer;
+}
+
+// Сегмент, открытый для чтения, в любом формате. Строки нумеруются с 0 (заголовок CSV
+// пропускается), поле 0 — первичный ключ. Границы полей CSV и двоичного сегмента размечаются
+// при открытии (scan = false — только точечное чтение через appendRowAt). Файлы столбцов
+// колоночного сегмента отображаются при первом обращении к полю, так что сканирование
+// с условием по одному столбцу читает только его.
+class SegmentReader {
+public:
+    SegmentReader(const std::string& fileName, SegmentFormat format, bool scan = true)
+        : file(fileName), format(format), data(file.view()), fileName(fileName) {
+        if (format == SegmentFormat::Columnar) {
+            openColumnar();
+        } else if (!scan) {
+            return;
+        } else if (format == SegmentFormat::Csv) {
+            block.tokenize(data);
+            first = 1;
+        } else {
+            parseBinary();
+        }
+    }
+
+    size_t rowCount() const {
+        if (format == SegmentFormat::Columnar) {
+            return rows;
+        }
+        return block.lineCount() > first ? block.lineCount() - first : 0;
+    }
+
+    size_t fieldCount(size_t row) const {
+        if (format == SegmentFormat::Columnar) {
+            return readBinary<uint32_t>(data, record(row) + sizeof(int32_t));
+        }
+        return block.fieldCount(row + first);
+    }
+
+    std::string_view field(size_t row, size_t index) const {
+        if (format == SegmentFormat::Columnar) {
+            return columnarField(row, index);
+        }
+        return block.field(data, row + first, index);
+    }
+
+    // У двоичного и колоночного сегмента pk хранится числом и не разбирается
+    int pk(size_t row) const {
+        if (format == SegmentFormat::Binary) {
+            return readBinary<int32_t>(data, rowOffsets[row] + sizeof(uint32_t));
+        }
+        if (format == SegmentFormat::Columnar) {
+            return readBinary<int32_t>(data, record(row));
+        }
+        std::string_view text = field(row, 0);
+        int pk = 0;
+        std::from_chars(text.data(), text.data() + text.size(), pk);
+        return pk;
+    }
+
+    // Положение строки для индекса первичного ключа: смещение от начала файла,
+    // у колоночного сегмента — номер строки
+    std::uintmax_t offset(size_t row) const {
+        switch (format) {
+        case SegmentFormat::Binary:
+            return rowOffsets[row];
+        case SegmentFormat::Columnar:
+            return row;
+        default:
+            return static_cast<std::uintmax_t>(block.line(data, row + first).data() - data.data());
+        }
+    }
+
+    // Дописывает строку в текстовом виде "pk,v1,v2", как она выдаётся в результат
+    void appendRow(size_t row, std::string& out) const {
+        if (format == SegmentFormat::Csv) {
+            out.append(block.line(data, row + first));
+            return;
+        }
+        // pk колоночного сегмента пишется числом, без построения текстового столбца pk
+        size_t firstField = 0;
+        if (format == SegmentFormat::Columnar) {
+            out.append(std::to_string(pk(row)));
+            firstField = 1;
+        }
+        for (size_t i = firstField; i < fieldCount(row); ++i) {
+            if (i > 0) {
+                out.push_back(',');
+            }
+            out.append(field(row, i));
+        }
+    }
+
+    // То же по положению из индекса первичного ключа (см. offset); разметка сегмента не нужна
+    void appendRowAt(std::uintmax_t location, std::string& out) const {
+        if (format == SegmentFormat::Columnar) {
+            appendRow(static_cast<size_t>(location), out);
+            return;
+        }
+        std::string_view row = data.substr(static_cast<size_t>(location));
+        if (format == SegmentFormat::Csv) {
+            row = row.substr(0, row.find('\n'));
+            if (!row.empty() && row.back() == '\r') {
+                row.remove_suffix(1);
+            }
+            out.append(row);
+            return;
+        }
+        uint32_t fieldCount = readBinary<uint32_t>(row, 8);
+        size_t pos = 12;
+        for (uint32_t i = 0; i < fieldCount; ++i) {
+            uint32_t length = readBinary<uint32_t>(row, pos);
+            if (i > 0) {
+                out.push_back(',');
+            }
+            out.append(row.substr(pos + sizeof(uint32_t), length));
+            pos += sizeof(uint32_t) + length;
+        }
+    }
+
+    // Поля строки по положению из индекса первичного ключа (см. offset); разметка сегмента
+    // не нужна, строка CSV размечается отдельно тем же CsvBlock. Представления действительны
+    // до следующего вызова.
+    void fieldsAt(std::uintmax_t location, std::vector<std::string_view>& fields) const {
+        fields.clear();
+        if (format == SegmentFormat::Columnar) {
+            size_t row = static_cast<size_t>(location);
+            rowPk = std::to_string(pk(row));
+            fields.push_back(rowPk);
+            for (size_t i = 1; i < fieldCount(row); ++i) {
+                fields.push_back(columnarField(row, i));
+            }
+            return;
+        }
+        std::string_view row = data.substr(static_cast<size_t>(location));
+        if (format == SegmentFormat::Csv) {
+            row = row.substr(0, row.find('\n'));
+            rowBlock.tokenize(row);
+            for (size_t i = 0; rowBlock.lineCount() > 0 && i < rowBlock.fieldCount(0); ++i) {
+                fields.push_back(rowBlock.field(row, 0, i));
+            }
+            return;
+        }
+        uint32_t fieldCount = readBinary<uint32_t>(row, 8);
+        size_t pos = 12;
+        for (uint32_t i = 0; i < fieldCount && pos + sizeof(uint32_t) <= row.size(); ++i) {
+            uint32_t length = readBinary<uint32_t>(row, pos);
+            fields.push_back(row.substr(pos + sizeof(uint32_t), length));
+            pos += sizeof(uint32_t) + length;
+        }
+    }
+
+    // Двоичный сегмент завершён подвалом
+    bool sealed() const {
+        return hasFooter;
+    }
+
+    // Размер файла без недописанной последней строки (остающейся после аварийного завершения)
+    std::uintmax_t validSize() const {
+        switch (format) {
+        case SegmentFormat::Binary:
+            return hasFooter ? data.size() : binaryEnd;
+        case SegmentFormat::Columnar:
+            return data.size() < columnarHeaderSize ? data.size() : columnarHeaderSize + rows * recordSize;
+        default: {
+            size_t newline = data.rfind('\n');
+            return newline == std::string_view::npos ? data.size() : newline + 1;
+        }
+        }
+    }
+
+private:
+    MappedFile file;
+    SegmentFormat format;
+    std::string_view data;
+    std::string fileName;
+    CsvBlock block;
+    size_t first = 0;
+    std::vector<size_t> rowOffsets;
+    bool hasFooter = false;
+    size_t binaryEnd = 0;
+
+    size_t columnCount = 0;
+    size_t recordSize = 0;
+    size_t rows = 0;
+    mutable std::vector<std::unique_ptr<MappedFile>> columns; // по номеру поля, открываются по требованию
+    mutable std::string pkText;         // pk колоночного сегмента текстом, строится по требованию
+    mutable std::vector<size_t> pkEnds;
+    mutable CsvBlock rowBlock;          // разметка строки для fieldsAt
+    mutable std::string rowPk;
+
+    // Подвал даёт число записей и конец области данных; недописанная последняя запись
+    // (при аварийном завершении) отбрасывается
+    void parseBinary() {
+        size_t end = data.size();
+        if (end >= binaryHeaderSize + 8 && readBinary<uint32_t>(data, end - 4) == binaryFooterMagic) {
+            size_t count = readBinary<uint32_t>(data, end - 8);
+            if (8 + 8 * count <= end - binaryHeaderSize) {
+                end -= 8 + 8 * count;
+                rowOffsets.reserve(count);
+                hasFooter = true;
+            }
+        }
+
+        size_t pos = binaryHeaderSize;
+        while (pos + sizeof(uint32_t) <= end) {
+            size_t recordEnd = pos + sizeof(uint32_t) + readBinary<uint32_t>(data, pos);
+            if (recordEnd > end || recordEnd < pos + 12) {
+                break;
+            }
+            uint32_t fieldCount = readBinary<uint32_t>(data, pos + 8);
+            size_t fieldPos = pos + 12;
+            for (uint32_t i = 0; i < fieldCount && fieldPos + sizeof(uint32_t) <= recordEnd; ++i) {
+                size_t start = fieldPos + sizeof(uint32_t);
+                fieldPos = start + readBinary<uint32_t>(data, fieldPos);
+                block.fieldStarts.push_back(start);
+                block.fieldEnds.push_back(std::min(fieldPos, recordEnd));
+            }
+            block.lineEnds.push_back(block.fieldEnds.size());
+            rowOffsets.push_back(pos);
+            pos = recordEnd;
+        }
+        binaryEnd = std::min(pos, data.size());
+    }
+
+    // Недописанная последняя запись каталога не учитывается
+    void openColumnar() {
+        if (data.size() < columnarHeaderSize) {
+            return;
+        }
+        columnCount = readBinary<uint32_t>(data, 4);
+        recordSize = sizeof(int32_t) + sizeof(uint32_t) + columnCount * sizeof(uint64_t);
+        rows = (data.size() - columnarHeaderSize) / recordSize;
+        columns.resize(columnCount + 1);
+    }
+
+    size_t record(size_t row) const {
+        return columnarHeaderSize + row * recordSize;
+    }
+
+    std::string_view columnarField(size_t row, size_t index) const {
+        if (index == 0) {
+            if (pkEnds.empty()) {
+                pkEnds.reserve(rows);
+                for (size_t i = 0; i < rows; ++i) {
+                    pkText.append(std::to_string(pk(i)));
+                    pkEnds.push_back(pkText.size());
+                }
+            }
+            size_t start = row == 0 ? 0 : pkEnds[row - 1];
+            return std::string_view(pkText).substr(start, pkEnds[row] - start);
+        }
+        if (!columns[index]) {
+            columns[index] = std::make_unique<MappedFile>(columnFile(fileName, index));
+        }
+        std::string_view column = columns[index]->view();
+        size_t start = static_cast<size_t>(readBinary<uint64_t>(data, record(row) + 8 + (index - 1) * sizeof(uint64_t)));
+        size_t end = column.find('\n', start);
+        return column.substr(start, end == std::string_view::npos ? std::string_view::npos : end - start);
+    }
 };
 
-// Основной класс СУБД
-class Database {
-private:
-    Schema schema;
-    std::mutex lock;
+// Дописывание строк в сегмент любого формата. Строки копятся в памяти и записываются в flush.
+// У колоночного сегмента сначала дописываются файлы столбцов, затем каталог строк, так что
+// каталог не ссылается на незаписанные значения. Поля сверх числа столбцов схемы колоночный
+// формат не хранит.
+class SegmentWriter {
+public:
+    // create: новый сегмент с заголовком (старые файлы с тем же именем удаляются);
+    // иначе строки дописываются в конец существующего
+    SegmentWriter(const std::string& fileName, SegmentFormat format, size_t columnCount, const std::string& csvHeader, bool create)
+        : fileName(fileName), format(format), columnCount(columnCount) {
+        if (format == SegmentFormat::Columnar) {
+            columns.resize(columnCount);
+            columnBytes.assign(columnCount, 0);
+            recordSize = sizeof(int32_t) + sizeof(uint32_t) + columnCount * sizeof(uint64_t);
+        }
+        if (create) {
+            for (const std::string& file : files()) {
+                fs::remove(file);
+            }
+            if (format == SegmentFormat::Csv) {
+                pending = csvHeader;
+            } else {
+                appendBinary(pending, format == SegmentFormat::Binary ? binarySegmentMagic : columnarSegmentMagic);
+                appendBinary(pending, format == SegmentFormat::Binary ? binarySegmentVersion : static_cast<uint32_t>(columnCount));
+            }
+            return;
+        }
+
+        fileBytes = fs::file_size(fileName);
+        if (format == SegmentFormat::Columnar) {
+            // Хвост недописанной записи каталога отрезается, иначе следующие записи сдвинутся
+            std::uintmax_t whole = columnarHeaderSize + (fileBytes - columnarHeaderSize) / recordSize * recordSize;
+            if (whole != fileBytes) {
+                fs::resize_file(fileName, whole);
+                fileBytes = whole;
+            }
+            for (size_t i = 0; i < columnCount; ++i) {
+                columnBytes[i] = fs::file_size(columnFile(fileName, i + 1));
+            }
+        }
+    }
+
+    // Положение следующей строки для индекса первичного ключа (см. SegmentReader::offset)
+    std::uintmax_t nextOffset() const {
+        if (format == SegmentFormat::Columnar) {
+            return (bytes() - columnarHeaderSize) / recordSize;
+        }
+        return bytes();
+    }
+
+    // Размер основного файла сегмента вместе с ещё не записанными строками
+    std::uintmax_t bytes() const {
+        return fileBytes + pending.size();
+    }
+
+    void append(int pk, const std::vector<std::string>& values) {
+        offsets.push_back(nextOffset());
+        std::string pkText = std::to_string(pk);
+        if (format == SegmentFormat::Csv) {
+            pending.append(pkText);
+            for (const std::string& value : values) {
+                pending.append(",").append(value);
+            }
+            pending.append("\n");
+            return;
+        }
+
+        if (format == SegmentFormat::Columnar) {
+            appendBinary(pending, static_cast<int32_t>(pk));
+            appendBinary(pending, static_cast<uint32_t>(std::min(values.size(), columnCount) + 1));
+            for (size_t i = 0; i < columnCount; ++i) {
+                appendBinary(pending, static_cast<uint64_t>(columnBytes[i] + columns[i].size()));
+                if (i < values.size()) {
+                    columns[i].append(values[i]);
+                }
+                columns[i].push_back('\n');
+            }
+            return;
+        }
+
+        size_t size = 2 * sizeof(uint32_t) + sizeof(int32_t) + pkText.size();
+        for (const std::string& value : values) {
+            size += sizeof(uint32_t) + value.size();
+        }
+        appendBinary(pending, static_cast<uint32_t>(size));
+        appendBinary(pending, static_cast<int32_t>(pk));
+        appendBinary(pending, static_cast<uint32_t>(values.size() + 1));
+        appendBinary(pending, static_cast<uint32_t>(pkText.size()));
+        pending.append(pkText);
+        for (const std::string& value : values) {
+            appendBinary(pending, static_cast<uint32_t>(value.size()));
+            pending.append(value);
+        }
+    }
+
+    // Подвал двоичного сегмента, целиком записанного этим писателем
+    void seal() {
+        if (format == SegmentFormat::Binary) {
+            pending.append(binarySegmentFooter(offsets));
+        }
+    }
+
+    void flush() {
+        for (size_t i = 0; i < columns.size(); ++i) {
+            appendFile(columnFile(fileName, i + 1), columns[i]);
+            columnBytes[i] += columns[i].size();
+            columns[i].clear();
+        }
+        appendFile(fileName, pending);
+        fileBytes += pending.size();
+        pending.clear();
+    }
+
+    std::vector<std::string> files() const {
+        return segmentFiles(fileName, format, columnCount);
+    }
+
+private:
+    std::string fileName;
+    SegmentFormat format;
+    size_t columnCount;
+    size_t recordSize = 0;
+    std::uintmax_t fileBytes = 0;
+    std::string pending;
+    std::vector<std::string> columns;
+    std::vector<std::uintmax_t> columnBytes;
+    std::vector<uint64_t> offsets;
+
+    static void appendFile(const std::string& name, const std::string& content) {
+        std::ofstream file(name, std::ios::app | std::ios::binary);
+        file << content;
+    }
+};
+
+// Блокировка таблицы: std::shared_mutex между потоками процесса и рекомендательная
+// блокировка файла <table>_lock (flock / LockFileEx) между процессами. Удовлетворяет
+// требованиям SharedLockable, так что используется через std::unique_lock и std::shared_lock.
+class TableLock {
+public:
+    explicit TableLock(const std::string& fileName) {
+#ifdef _WIN32
+        file = CreateFileA(fileName.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+            nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE) {
+            throw std::runtime_error("Could not open lock file: " + fileName);
+        }
+#else
+        fd = open(fileName.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd == -1) {
+            throw std::runtime_error("Could not open lock file: " + fileName);
+        }
+#endif
+    }
+
+    ~TableLock() {
+#ifdef _WIN32
+        CloseHandle(file);
+#else
+        close(fd);
+#endif
+    }
+
+    TableLock(const TableLock&) = delete;
+    TableLock& operator=(const TableLock&) = delete;
+
+    void lock() {
+        mutex.lock();
+        lockFile(true);
+    }
+
+    void unlock() {
+        unlockFile();
+        mutex.unlock();
+    }
+
+    // Файловую блокировку на чтение берёт первый читатель процесса и снимает последний
+    void lock_shared() {
+        mutex.lock_shared();
+        std::lock_guard<std::mutex> guard(readersMutex);
+        if (readers++ == 0) {
+            lockFile(false);
+        }
+    }
+
+    void unlock_shared() {
+        {
+            std::lock_guard<std::mutex> guard(readersMutex);
+            if (--readers == 0) {
+                unlockFile();
+            }
+        }
+        mutex.unlock_shared();
+    }
+
+    // Счётчик изменений таблицы хранится в самом файле блокировки; процесс, заметивший
+    // изменение, сделанное другим процессом, перечитывает метаданные таблицы.
+    // Вызывается только под блокировкой.
+    uint64_t readVersion() {
+        uint64_t version = 0;
+#ifdef _WIN32
+        OVERLAPPED overlapped = {};
+        DWORD bytesRead = 0;
+        ReadFile(file, &version, sizeof(version), &bytesRead, &overlapped);
+        if (bytesRead != sizeof(version)) {
+            version = 0;
+        }
+#else
+        if (pread(fd, &version, sizeof(version), 0) != sizeof(version)) {
+            version = 0;
+        }
+#endif
+        return version;
+    }
+
+    void writeVersion(uint64_t version) {
+#ifdef _WIN32
+        OVERLAPPED overlapped = {};
+        DWORD bytesWritten = 0;
+        WriteFile(file, &version, sizeof(version), &bytesWritten, &overlapped);
+#else
+        if (pwrite(fd, &version, sizeof(version), 0) != sizeof(version)) {
+            throw std::runtime_error("Could not update table version");
+        }
+#endif
+    }
+
+private:
+    std::shared_mutex mutex;
+    std::mutex readersMutex;
+    int readers = 0;
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+#else
+    int fd = -1;
+#endif
+
+    void lockFile(bool exclusive) {
+#ifdef _WIN32
+        OVERLAPPED overlapped = {};
+        if (!LockFileEx(file, exclusive ? LOCKFILE_EXCLUSIVE_LOCK : 0, 0, MAXDWORD, MAXDWORD, &overlapped)) {
+            throw std::runtime_error("Could not lock table file");
+        }
+#else
+        while (flock(fd, exclusive ? LOCK_EX : LOCK_SH) == -1) {
+            if (errno != EINTR) {
+                throw std::runtime_error("Could not lock table file");
+            }
+        }
+#endif
+    }
+
+    void unlockFile() {
+#ifdef _WIN32
+        OVERLAPPED overlapped = {};
+        UnlockFileEx(file, 0, MAXDWORD, MAXDWORD, &overlapped);
+#else
+        flock(fd, LOCK_UN);
+#endif
+    }
+};
+
+// Пул потоков фиксированного размера для параллельного сканирования сегментов
+class ThreadPool {
+public:
+    explicit ThreadPool(size_t threadCount) {
+        for (size_t i = 0; i < threadCount; ++i) {
+            workers.emplace_back([this] { workerLoop(); });
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (std::thread& worker : workers) {
+            worker.join();
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    size_t size() const {
+        return workers.size();
+    }
+
+    std::future<void> submit(std::function<void()> task) {
+        std::packaged_task<void()> packaged(std::move(task));
+        std::future<void> result = packaged.get_future();
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            tasks.push(std::move(packaged));
+        }
+        wake.notify_one();
+        return result;
+    }
+
+private:
+    std::vector<std::thread> workers;
+    std::queue<std::packaged_task<void()>> tasks;
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool stopping = false;
+
+    void workerLoop() {
+        for (;;) {
+            std::packaged_task<void()> task;
+            {
+                std::unique_lock<std::mutex> guard(mutex);
+                wake.wait(guard, [this] { return stopping || !tasks.empty(); });
+                if (tasks.empty()) {
+                    return;
+                }
+                task = std::move(tasks.front());
+                tasks.pop();
+            }
+            task();
+        }
+    }
+};
+
+// Запись журнала упреждающей записи: вставка строки с уже выданным pk или удаление по pk
+struct WalRecord {
+    enum class Type : uint8_t {
+        Insert = 'I',
+        Delete = 'D'
+    };
+
+    Type type;
+    std::string tableName;
+    int pk;
+    std::vector<std::string> values;
+};
+
+// Журнал упреждающей записи базы данных (файл <база>/wal). Запись в журнале:
+// [u32 длина][u32 контрольная сумма][тип][u32 длина][таблица][i32 pk][u32 число значений]([u32 длина][байты])...
+// append копит записи в памяти, commit ждёт, пока они окажутся на диске. Групповая фиксация:
+// первый ожидающий поток пишет и сбрасывает на диск (fsync) всё накопленное, остальные ждут
+// его, так что одновременные изменения делят один fsync. Запись в файл между процессами
+// сериализуется блокировкой <база>/wal_lock, контрольные точки — <база>/wal_checkpoint_lock.
+class WriteAheadLog {
+public:
+    explicit WriteAheadLog(const std::string& fileName)
+        : fileName(fileName), fileLock(fileName + "_lock"), checkpointLock(fileName + "_checkpoint_lock") {
+    }
+
+    static void encode(WalRecord::Type type, const std::string& tableName, int pk,
+        const std::vector<std::string>& values, std::string& out) {
+        std::string payload;
+        payload.push_back(static_cast<char>(type));
+        appendBinary(payload, static_cast<uint32_t>(tableName.size()));
+        payload.append(tableName);
+        appendBinary(payload, static_cast<int32_t>(pk));
+        appendBinary(payload, static_cast<uint32_t>(values.size()));
+        for (const std::string& value : values) {
+            appendBinary(payload, static_cast<uint32_t>(value.size()));
+            payload.append(value);
+        }
+        appendBinary(out, static_cast<uint32_t>(payload.size()));
+        appendBinary(out, static_cast<uint32_t>(stableHash(payload)));
+        out.append(payload);
+    }
+
+    // Номер, который передаётся в commit
+    uint64_t append(const std::string& records) {
+        std::lock_guard<std::mutex> guard(mutex);
+        pending.append(records);
+        return ++appended;
+    }
+
+    // Если запись не удалась, недописанный хвост файла отрезается, а пакет возвращается
+    // в начало очереди: durable не продвигается, и следующая фиксация запишет его снова.
+    // Ошибка передаётся вызвавшему потоку.
+    void commit(uint64_t sequence) {
+        std::unique_lock<std::mutex> guard(mutex);
+        while (durable < sequence) {
+            if (flushing) {
+                flushed.wait(guard);
+                continue;
+            }
+            flushing = true;
+            std::string batch;
+            batch.swap(pending);
+            uint64_t batchEnd = appended;
+            guard.unlock();
+            try {
+                std::lock_guard<TableLock> fileGuard(fileLock);
+                std::uintmax_t written = size();
+                std::ofstream file(fileName, std::ios::app | std::ios::binary);
+                file << batch;
+                file.close();
+                if (!file || !syncFile(fileName)) {
+                    std::error_code error;
+                    fs::resize_file(fileName, written, error);
+                    throw std::runtime_error("Could not write log file: " + fileName);
+                }
+            } catch (...) {
+                guard.lock();
+                pending.insert(0, batch);
+                flushing = false;
+                flushed.notify_all();
+                throw;
+            }
+            guard.lock();
+            flushing = false;
+            durable = batchEnd;
+            flushed.notify_all();
+        }
+    }
+
+    std::uintmax_t size() {
+        std::error_code error;
+        std::uintmax_t bytes = fs::file_size(fileName, error);
+        return error ? 0 : bytes;
+    }
+
+    // Контрольная точка: запоминается размер журнала, flushData сбрасывает на диск файлы
+    // таблиц, после чего из журнала вырезается запомненная часть. Блокировка файла журнала
+    // берётся только на время вырезания, так что фиксации во время flushData не ждут;
+    // дописанное за это время переносится в новый файл журнала.
+    template <typename FlushData>
+    void checkpoint(FlushData flushData) {
+        std::lock_guard<TableLock> checkpointGuard(checkpointLock);
+        std::uintmax_t logged;
+        {
+            std::lock_guard<TableLock> fileGuard(fileLock);
+            logged = size();
+        }
+        if (logged == 0) {
+            return;
+        }
+        flushData();
+
+        std::lock_guard<TableLock> fileGuard(fileLock);
+        std::uintmax_t bytes = size();
+        if (bytes == logged) {
+            fs::resize_file(fileName, 0);
+            syncFile(fileName);
+            return;
+        }
+        std::string rest(static_cast<size_t>(bytes - logged), '\0');
+        std::ifstream inFile(fileName, std::ios::binary);
+        inFile.seekg(static_cast<std::streamoff>(logged));
+        inFile.read(rest.data(), static_cast<std::streamsize>(rest.size()));
+        inFile.close();
+        std::string tmpFile = fileName + ".tmp";
+        std::ofstream outFile(tmpFile, std::ios::trunc | std::ios::binary);
+        outFile << rest;
+        outFile.close();
+        if (!outFile || !syncFile(tmpFile)) {
+            throw std::runtime_error("Could not write log file: " + tmpFile);
+        }
+        fs::rename(tmpFile, fileName);
+    }
+
+    // Записи до первой повреждённой или недописанной; всё после неё отрезается,
+    // иначе новые записи оказались бы за ней и не читались бы
+    std::vector<WalRecord> read() {
+        std::lock_guard<TableLock> fileGuard(fileLock);
+        std::vector<WalRecord> records;
+        std::ifstream file(fileName, std::ios::binary);
+        std::string data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        std::string_view view = data;
+        size_t pos = 0;
+        while (pos + 8 <= view.size()) {
+            uint32_t length = readBinary<uint32_t>(view, pos);
+            if (pos + 8 + length > view.size()
+                || readBinary<uint32_t>(view, pos + 4) != static_cast<uint32_t>(stableHash(view.substr(pos + 8, length)))) {
+                break;
+            }
+            std::string_view payload = view.substr(pos + 8, length);
+            WalRecord& record = records.emplace_back();
+            record.type = static_cast<WalRecord::Type>(payload[0]);
+            size_t offset = 1;
+            uint32_t nameLength = readBinary<uint32_t>(payload, offset);
+            record.tableName = payload.substr(offset + 4, nameLength);
+            offset += 4 + nameLength;
+            record.pk = readBinary<int32_t>(payload, offset);
+            uint32_t count = readBinary<uint32_t>(payload, offset + 4);
+            offset += 8;
+            for (uint32_t i = 0; i < count; ++i) {
+                uint32_t valueLength = readBinary<uint32_t>(payload, offset);
+                record.values.emplace_back(payload.substr(offset + 4, valueLength));
+                offset += 4 + valueLength;
+            }
+            pos += 8 + length;
+        }
+        if (pos < data.size()) {
+            fs::resize_file(fileName, pos);
+            syncFile(fileName);
+        }
+        return records;
+    }
+
+private:
+    std::string fileName;
+    TableLock fileLock;
+    TableLock checkpointLock;
+    std::mutex mutex;
+    std::condition_variable flushed;
+    std::string pending;
+    uint64_t appended = 0;
+    uint64_t durable = 0;
+    bool flushing = false;
+};
+
+// Основной класс СУБД
+class Database {
+private:
+    Schema schema;
+    std::map<std::string, std::unique_ptr<TableLock>> tableLocks;
+    std::map<std::string, uint64_t> tableVersions;
+    std::map<std::string, PkRange> pkRanges; // заполняется в конструкторе, как и tableLocks
+    std::map<std::string, QueryPlan> planCache; // форма запроса (таблица и столбцы) -> план без значений
+    std::mutex planCacheMutex;
+    std::unique_ptr<ThreadPool> scanPool; // создаётся при первом параллельном сканировании
+    std::once_flag scanPoolCreated;
+
+    static constexpr int pkReserveBlock = 1000;
+    std::map<std::string, TableManifest> manifests;
+    std::map<std::string, std::map<int, RowLocation>> pkIndexes;
+    std::map<std::string, std::unordered_map<int, int>> tombstones; // pk -> сегмент
+    std::map<std::string, std::map<int, BPlusTree<IndexKey, int>>> rangeIndexes; // номер поля -> значение -> pk
+
+    std::thread compactor;
+    std::mutex compactionMutex;
+    std::condition_variable compactionWake;
+    std::set<std::string> compactionQueue;
+    bool stopping = false;
+
+    // Файлы таблиц, кроме заполненных сегментов, пишутся без fsync; сохранность изменений
+    // обеспечивает журнал, а контрольная точка сбрасывает файлы на диск и очищает журнал,
+    // когда он вырастает до walCheckpointBytes
+    static constexpr std::uintmax_t walCheckpointBytes = 4 << 20;
+    std::unique_ptr<WriteAheadLog> wal;
+    std::thread checkpointer;
+    std::mutex checkpointMutex;
+    std::condition_variable checkpointWake;
+    bool checkpointRequested = false;
+    bool checkpointStopping = false;
+
+    std::string getTableDir(const std::string& tableName) {
+        return schema.name + "/" + tableName;
+    }
+
+    ThreadPool& getScanPool() {
+        std::call_once(scanPoolCreated, [this] {
+            scanPool = std::make_unique<ThreadPool>(std::max(1u, std::thread::hardware_concurrency()));
+        });
+        return *scanPool;
+    }
+
+    std::string getPrimaryKeyFile(const std::string& tableName) {
+        return getTableDir(tableName) + "/" + tableName + "_pk_sequence";
+    }
+
+    std::string getLockFile(const std::string& tableName) {
+        return getTableDir(tableName) + "/" + tableName + "_lock";
+    }
+
+    std::string getManifestFile(const std::string& tableName) {
+        return getTableDir(tableName) + "/" + tableName + "_manifest";
+    }
+
+    std::string getPkIndexFile(const std::string& tableName) {
+        return getTableDir(tableName) + "/" + tableName + "_pk_index";
+    }
+
+    std::string getTombstoneFile(const std::string& tableName) {
+        return getTableDir(tableName) + "/" + tableName + "_tombstones";
+    }
+
+    // Отметка сжатия: строки "новый исходные..." для каждой сливаемой группы. Пишется до
+    // файлов нового сегмента и удаляется, когда исходные удалены, а индекс обновлён
+    std::string getCompactionFile(const std::string& tableName) {
+        return getTableDir(tableName) + "/" + tableName + "_compaction";
+    }
+
+    std::string getRangeIndexFile(const std::string& tableName, const std::string& columnName) {
+        return getTableDir(tableName) + "/" + tableName + "_" + columnName + "_btree";
+    }
+
+    std::string getSegmentFile(const std::string& tableName, int segmentId) {
+        return getSegmentFile(tableName, segmentId, manifests.at(tableName).format);
+    }
+
+    std::string getSegmentFile(const std::string& tableName, int segmentId, SegmentFormat format) {
+        return getTableDir(tableName) + "/" + std::to_string(segmentId) + segmentExtension(format);
+    }
+
+    void removeSegment(const std::string& tableName, int segmentId) {
+        removeSegment(tableName, segmentId, getFormat(tableName));
+    }
+
+    // Формат задаётся явно: при загрузке манифест таблицы ещё не установлен
+    void removeSegment(const std::string& tableName, int segmentId, SegmentFormat format) {
+        for (const std::string& file : segmentFiles(getSegmentFile(tableName, segmentId, format), format, schema.structure.at(tableName).size())) {
+            fs::remove(file);
+        }
+        for (int field : getBloomFields(tableName)) {
+            fs::remove(getBloomFile(tableName, segmentId, field));
+        }
+    }
+
+    std::string getBloomFile(const std::string& tableName, int segmentId, int field) {
+        return getTableDir(tableName) + "/" + std::to_string(segmentId) + "_" + schema.structure.at(tableName)[field - 1] + ".bloom";
+    }
+
+    // Номера полей столбцов, для которых схема требует фильтры Блума
+    std::vector<int> getBloomFields(const std::string& tableName) {
+        std::vector<int> fields;
+        auto it = schema.bloomFilters.find(tableName);
+        if (it == schema.bloomFilters.end()) {
+            return fields;
+        }
+        for (const std::string& columnName : it->second) {
+            int field = getColumnIndex(tableName, columnName);
+            if (field < 1) {
+                throw std::runtime_error("Column does not exist: " + tableName + "." + columnName);
+            }
+            fields.push_back(field);
+        }
+        return fields;
+    }
+
+    // Пустые фильтры сегмента, рассчитанные на tuples_limit строк
+    std::map<int, BloomFilter> newBloomFilters(const std::string& tableName) {
+        std::map<int, BloomFilter> blooms;
+        for (int field : getBloomFields(tableName)) {
+            blooms.emplace(field, BloomFilter(static_cast<size_t>(schema.tuples_limit)));
+        }
+        return blooms;
+    }
+
+    static void addToBlooms(std::map<int, BloomFilter>& blooms, const std::vector<std::string>& values) {
+        for (auto& [field, bloom] : blooms) {
+            if (static_cast<size_t>(field) <= values.size()) {
+                bloom.add(values[field - 1]);
+            }
+        }
+    }
+
+    void saveBloomFilters(const std::string& tableName, int segmentId, const std::map<int, BloomFilter>& blooms) {
+        for (const auto& [field, bloom] : blooms) {
+            std::string bloomFile = getBloomFile(tableName, segmentId, field);
+            std::ofstream outFile(bloomFile + ".tmp", std::ios::trunc | std::ios::binary);
+            outFile << bloom.serialize();
+            outFile.close();
+            syncFile(bloomFile + ".tmp");
+            fs::rename(bloomFile + ".tmp", bloomFile);
+        }
+    }
+
+    // Фильтры запечатанных сегментов читаются из файлов N_<столбец>.bloom; недостающие или
+    // повреждённые строятся по данным сегмента и сохраняются. Фильтры хвостового сегмента
+    // хранятся только в памяти (пополняются вставкой) и строятся заново.
+    void loadBloomFilters(const std::string& tableName) {
+        std::vector<SegmentInfo>& segments = manifests.at(tableName).segments;
+        for (SegmentInfo& segment : segments) {
+            segment.blooms = newBloomFilters(tableName);
+            if (segment.blooms.empty()) {
+                continue;
+            }
+            bool rebuild = segment.id == segments.back().id;
+            for (auto& [field, bloom] : segment.blooms) {
+                std::ifstream inFile(getBloomFile(tableName, segment.id, field), std::ios::binary);
+                std::string data((std::istreambuf_iterator<char>(inFile)), std::istreambuf_iterator<char>());
+                rebuild = rebuild || !bloom.deserialize(data);
+            }
+            if (!rebuild) {
+                continue;
+            }
+
+            segment.blooms = newBloomFilters(tableName);
+            SegmentReader reader(getSegmentFile(tableName, segment.id), getFormat(tableName));
+            for (size_t row = 0; row < reader.rowCount(); ++row) {
+                for (auto& [field, bloom] : segment.blooms) {
+                    if (static_cast<size_t>(field) < reader.fieldCount(row)) {
+                        bloom.add(reader.field(row, field));
+                    }
+                }
+            }
+            if (segment.id != segments.back().id) {
+                saveBloomFilters(tableName, segment.id, segment.blooms);
+            }
+        }
+    }
+
+    SegmentWriter openSegment(const std::string& tableName, int segmentId, bool create) {
+        return SegmentWriter(getSegmentFile(tableName, segmentId), getFormat(tableName),
+            schema.structure.at(tableName).size(), getSegmentHeader(tableName), create);
+    }
+
+    SegmentFormat getFormat(const std::string& tableName) {
+        return manifests.at(tableName).format;
+    }
+
+    // Считает строки данных (без заголовка) в файле сегмента
+    int countSegmentRows(const std::string& fileName, SegmentFormat format) {
+        if (format != SegmentFormat::Csv) {
+            return static_cast<int>(SegmentReader(fileName, format).rowCount());
+        }
+        std::ifstream file(fileName, std::ios::binary);
+        int lineCount = std::count(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>(), '\n');
+        return std::max(lineCount - 1, 0);
+    }
+
+    // Загружает манифест таблицы. Число строк хвостового сегмента не сохраняется при каждой
+    // вставке, поэтому пересчитывается здесь; сегменты, созданные после последней записи
+    // манифеста (например, при аварийном завершении), добавляются в конец.
+    // Таблица без манифеста получает формат из схемы, если у неё ещё нет сегментов CSV.
+    // Возвращает сегменты, которые нужно переиндексировать: записанные прерванным сжатием
+    // и добавленные в конец.
+    std::set<int> loadManifest(const std::string& tableName) {
+        TableManifest manifest;
+        std::ifstream inFile(getManifestFile(tableName));
+        if (inFile.is_open()) {
+            json manifestJson;
+            inFile >> manifestJson;
+            manifest.format = parseSegmentFormat(manifestJson.value("format", "csv"));
+            for (const auto& segment : manifestJson["segments"]) {
+                manifest.segments.push_back({ segment["id"], segment["rows"], segment["bytes"] });
+                if (segment.contains("stats")) {
+                    manifest.segments.back().stats = statsFromJson(segment["stats"]);
+                }
+            }
+            inFile.close();
+        } else if (!fs::exists(getSegmentFile(tableName, 1, SegmentFormat::Csv))) {
+            manifest.format = schema.format;
+        }
+
+        // Сегменты без файлов пропускаются
+        std::erase_if(manifest.segments, [&](const SegmentInfo& segment) {
+            return !fs::exists(getSegmentFile(tableName, segment.id, manifest.format));
+        });
+        std::set<int> changed = recoverCompaction(tableName, manifest);
+        if (!manifest.segments.empty()) {
+            SegmentInfo& tail = manifest.segments.back();
+            std::string fileName = getSegmentFile(tableName, tail.id, manifest.format);
+            // Недописанная строка отрезается, иначе следующая вставка склеится с ней.
+            // Таблица загружается под исключительной блокировкой, так что её никто не дописывает.
+            std::uintmax_t validSize = SegmentReader(fileName, manifest.format, manifest.format != SegmentFormat::Csv).validSize();
+            if (validSize < fs::file_size(fileName)) {
+                fs::resize_file(fileName, validSize);
+            }
+            tail.rows = countSegmentRows(fileName, manifest.format);
+            tail.bytes = fs::file_size(fileName);
+            tail.sealed = manifest.format == SegmentFormat::Binary && SegmentReader(fileName, manifest.format).sealed();
+        }
+
+        for (int nextId = nextSegmentId(manifest.segments);; ++nextId) {
+            std::string fileName = getSegmentFile(tableName, nextId, manifest.format);
+            if (!fs::exists(fileName)) {
+                break;
+            }
+            manifest.segments.push_back({ nextId, countSegmentRows(fileName, manifest.format), fs::file_size(fileName) });
+            changed.insert(nextId);
+        }
+
+        // Сводка хвостового сегмента не сохраняется (он ещё пополняется) и строится заново,
+        // как и сводки сегментов, которых нет в манифесте или которые переписаны после него
+        for (size_t i = 0; i < manifest.segments.size(); ++i) {
+            SegmentInfo& segment = manifest.segments[i];
+            if (i + 1 == manifest.segments.size() || segment.stats.columns.size() != schema.structure.at(tableName).size() + 1) {
+                segment.stats = computeStats(tableName, getSegmentFile(tableName, segment.id, manifest.format), manifest.format);
+            }
+        }
+
+        manifests[tableName] = manifest;
+        saveManifest(tableName);
+        return changed;
+    }
+
+    // Доводит прерванное сжатие по отметке. Сжатие переключается на новые сегменты одной
+    // записью манифеста: если исходных сегментов группы в нём уже нет, удаляются их
+    // оставшиеся файлы, а новый сегмент отдаётся на переиндексацию; иначе удаляется
+    // недописанный новый сегмент. Возвращает сегменты для переиндексации.
+    std::set<int> recoverCompaction(const std::string& tableName, const TableManifest& manifest) {
+        auto listed = [&](int segmentId) {
+            return std::any_of(manifest.segments.begin(), manifest.segments.end(),
+                [&](const SegmentInfo& segment) { return segment.id == segmentId; });
+        };
+        std::set<int> changed;
+        std::ifstream compactionFile(getCompactionFile(tableName));
+        std::string line;
+        while (std::getline(compactionFile, line)) {
+            std::istringstream ids(line);
+            int mergedId = 0;
+            std::vector<int> sources;
+            ids >> mergedId;
+            for (int sourceId; ids >> sourceId;) {
+                sources.push_back(sourceId);
+            }
+            if (sources.empty()) {
+                continue;
+            }
+            if (std::none_of(sources.begin(), sources.end(), listed)) {
+                for (int sourceId : sources) {
+                    removeSegment(tableName, sourceId, manifest.format);
+                }
+                if (listed(mergedId)) {
+                    changed.insert(mergedId);
+                    continue;
+                }
+            }
+            if (!listed(mergedId)) {
+                removeSegment(tableName, mergedId, manifest.format);
+            }
+        }
+        return changed;
+    }
+
+    // Номер для нового сегмента. Сжатие записывает результат под новым номером, поэтому
+    // номера в манифесте не упорядочены и у хвостового сегмента не обязательно наибольший.
+    static int nextSegmentId(const std::vector<SegmentInfo>& segments) {
+        int maxId = 0;
+        for (const SegmentInfo& segment : segments) {
+            maxId = std::max(maxId, segment.id);
+        }
+        return maxId + 1;
+    }
 
-    std::string getTableDir(const std::string& tableName) {
-        return schema.name + "/" + tableName;
+    // Временные файлы (".tmp" перед переименованием) остаются только после сбоя: таблица
+    // загружается под исключительной блокировкой, и их никто не пишет
+    void removeTemporaryFiles(const std::string& tableName) {
+        std::vector<fs::path> leftovers;
+        for (const fs::directory_entry& entry : fs::directory_iterator(getTableDir(tableName))) {
+            if (entry.path().filename().string().find(".tmp") != std::string::npos) {
+                leftovers.push_back(entry.path());
+            }
+        }
+        for (const fs::path& file : leftovers) {
+            fs::remove(file);
+        }
     }
 
-    std::string getPrimaryKeyFile(const std::string& tableName) {
-        return getTableDir(tableName) + "/" + tableName + "_pk_sequence";
+    SegmentStats computeStats(const std::string& tableName, const std::string& fileName, SegmentFormat format) {
+        SegmentStats stats;
+        stats.columns.resize(schema.structure.at(tableName).size() + 1);
+        SegmentReader reader(fileName, format);
+        for (size_t row = 0; row < reader.rowCount(); ++row) {
+            stats.columns[0].add(std::to_string(reader.pk(row)));
+            for (size_t field = 1; field < reader.fieldCount(row) && field < stats.columns.size(); ++field) {
+                stats.columns[field].add(reader.field(row, field));
+            }
+        }
+        return stats;
     }
 
-    std::string getLockFile(const std::string& tableName) {
-        return getTableDir(tableName) + "/" + tableName + "_lock";
+    // Перезаписывает манифест атомарно: через временный файл и переименование.
+    // Сводки сохраняются для запечатанных сегментов.
+    void saveManifest(const std::string& tableName) {
+        json manifestJson;
+        manifestJson["format"] = formatName(manifests.at(tableName).format);
+        manifestJson["segments"] = json::array();
+        const std::vector<SegmentInfo>& segments = manifests.at(tableName).segments;
+        for (const SegmentInfo& segment : segments) {
+            json entry = { {"id", segment.id}, {"rows", segment.rows}, {"bytes", segment.bytes} };
+            if (segment.id != segments.back().id && !segment.stats.columns.empty()) {
+                entry["stats"] = statsToJson(segment.stats);
+            }
+            manifestJson["segments"].push_back(entry);
+        }
+
+        std::string manifestFile = getManifestFile(tableName);
+        std::string tmpFile = manifestFile + ".tmp";
+        std::ofstream outFile(tmpFile, std::ios::trunc);
+        outFile << manifestJson.dump();
+        outFile.close();
+        syncFile(tmpFile);
+        fs::rename(tmpFile, manifestFile);
+    }
+
+    std::string getSegmentHeader(const std::string& tableName) {
+        return tableName + "_pk," + join(schema.structure.at(tableName), ",") + "\n";
+    }
+
+    // Дописывает подвал в заполненный двоичный сегмент. Сегмент CSV подвала не имеет.
+    void sealSegment(const std::string& tableName, SegmentInfo& segment) {
+        if (getFormat(tableName) != SegmentFormat::Binary || segment.sealed) {
+            return;
+        }
+        std::string fileName = getSegmentFile(tableName, segment.id);
+        std::vector<uint64_t> offsets;
+        {
+            SegmentReader reader(fileName, SegmentFormat::Binary);
+            if (reader.sealed()) {
+                segment.sealed = true;
+                return;
+            }
+            for (size_t row = 0; row < reader.rowCount(); ++row) {
+                offsets.push_back(reader.offset(row));
+            }
+        }
+        std::string footer = binarySegmentFooter(offsets);
+        appendToSegment(tableName, segment.id, footer);
+        segment.bytes += footer.size();
+        segment.sealed = true;
+    }
+
+    SegmentInfo& findSegment(const std::string& tableName, int segmentId) {
+        std::vector<SegmentInfo>& segments = manifests.at(tableName).segments;
+        auto it = std::find_if(segments.begin(), segments.end(),
+            [&](const SegmentInfo& segment) { return segment.id == segmentId; });
+        if (it == segments.end()) {
+            throw std::runtime_error("Segment not found in manifest: " + std::to_string(segmentId));
+        }
+        return *it;
+    }
+
+    // Индекс первичного ключа хранится журналом строк "pk сегмент смещение"; сегмент 0
+    // означает удалённый ключ. При загрузке журнал проигрывается и переписывается компактно.
+    // reindexAll: индекс строится заново по сегментам без журнала (после сбоя, перед
+    // проигрыванием WAL), так как журнал мог отстать от сегментов или опередить их.
+    void loadPkIndex(const std::string& tableName, bool reindexAll, const std::set<int>& changed) {
+        std::map<int, RowLocation>& index = pkIndexes[tableName];
+        index.clear();
+
+        std::ifstream inFile(getPkIndexFile(tableName));
+        bool rebuild = reindexAll || !inFile.is_open();
+        int pk;
+        RowLocation location;
+        while (!reindexAll && inFile >> pk >> location.segmentId >> location.offset) {
+            if (location.segmentId == 0) {
+                index.erase(pk);
+            } else {
+                index[pk] = location;
+            }
+        }
+        inFile.close();
+
+        // Хвостовой сегмент индексируется заново: последняя вставка могла не попасть в журнал
+        const std::vector<SegmentInfo>& segments = manifests.at(tableName).segments;
+        for (const SegmentInfo& segment : segments) {
+            if (rebuild || segment.id == segments.back().id || changed.count(segment.id) != 0) {
+                indexSegment(tableName, segment.id, nullptr);
+            }
+        }
+
+        std::string indexFile = getPkIndexFile(tableName);
+        std::string tmpFile = indexFile + ".tmp";
+        std::ofstream outFile(tmpFile, std::ios::trunc);
+        for (const auto& [key, entry] : index) {
+            outFile << key << " " << entry.segmentId << " " << entry.offset << "\n";
+        }
+        outFile.close();
+        fs::rename(tmpFile, indexFile);
+    }
+
+    // Удаления хранятся журналом строк "pk сегмент" до сжатия сегмента. Отметка остаётся,
+    // только если ключ действительно есть в её сегменте (после сбоя сжатия журнал может
+    // указывать на переписанный сегмент), и по ним же заново считаются удалённые строки.
+    void loadTombstones(const std::string& tableName) {
+        std::unordered_map<int, int>& deleted = tombstones[tableName];
+        deleted.clear();
+
+        std::ifstream inFile(getTombstoneFile(tableName));
+        int pk;
+        int segmentId;
+        while (inFile >> pk >> segmentId) {
+            deleted[pk] = segmentId;
+        }
+        inFile.close();
+
+        std::map<int, std::set<int>> present;
+        for (const auto& [key, segmentId] : deleted) {
+            present.emplace(segmentId, std::set<int>());
+        }
+        for (auto& [segmentId, pks] : present) {
+            const std::vector<SegmentInfo>& segments = manifests.at(tableName).segments;
+            if (std::none_of(segments.begin(), segments.end(), [&](const SegmentInfo& segment) { return segment.id == segmentId; })) {
+                continue;
+            }
+            SegmentReader reader(getSegmentFile(tableName, segmentId), getFormat(tableName));
+            for (size_t row = 0; row < reader.rowCount(); ++row) {
+                pks.insert(reader.pk(row));
+            }
+        }
+        std::erase_if(deleted, [&](const auto& entry) {
+            return present.at(entry.second).count(entry.first) == 0;
+        });
+        for (const auto& [key, segmentId] : deleted) {
+            findSegment(tableName, segmentId).deadRows++;
+        }
+        saveTombstones(tableName);
+    }
+
+    // B+дерево по столбцу хранится файлом рядом с таблицей: журнал строк "pk значение".
+    // Индексы есть у тех столбцов, для которых есть файл. При загрузке журнал проигрывается
+    // без удалённых ключей, дополняется строками хвостового сегмента и переписывается по порядку ключей.
+    // reindexAll: журнал не читается, дерево строится по всем сегментам.
+    void loadRangeIndexes(const std::string& tableName, bool reindexAll) {
+        std::map<int, BPlusTree<IndexKey, int>>& indexes = rangeIndexes[tableName];
+        indexes.clear();
+        const std::map<int, RowLocation>& pkIndex = pkIndexes.at(tableName);
+        const std::vector<std::string>& columns = schema.structure.at(tableName);
+
+        for (size_t i = 0; i < columns.size(); ++i) {
+            std::string indexFile = getRangeIndexFile(tableName, columns[i]);
+            std::ifstream inFile(indexFile);
+            if (!inFile.is_open()) {
+                continue;
+            }
+            int field = static_cast<int>(i) + 1;
+            BPlusTree<IndexKey, int>& tree = indexes[field];
+            std::set<int> loaded;
+            std::string line;
+            while (!reindexAll && std::getline(inFile, line)) {
+                size_t space = line.find(' ');
+                int pk = parsePk(std::string_view(line).substr(0, space));
+                if (space == std::string::npos || pkIndex.find(pk) == pkIndex.end() || !loaded.insert(pk).second) {
+                    continue;
+                }
+                tree.insert(IndexKey::from(std::string_view(line).substr(space + 1)), pk);
+            }
+            inFile.close();
+
+            // Последняя вставка могла не попасть в журнал
+            const std::vector<SegmentInfo>& segments = manifests.at(tableName).segments;
+            for (size_t j = reindexAll ? 0 : segments.size() - std::min<size_t>(segments.size(), 1); j < segments.size(); ++j) {
+                SegmentReader reader(getSegmentFile(tableName, segments[j].id), getFormat(tableName));
+                for (size_t row = 0; row < reader.rowCount(); ++row) {
+                    int pk = reader.pk(row);
+                    if (pkIndex.find(pk) != pkIndex.end() && loaded.insert(pk).second) {
+                        std::string_view value = static_cast<size_t>(field) < reader.fieldCount(row) ? reader.field(row, field) : std::string_view();
+                        tree.insert(IndexKey::from(value), pk);
+                    }
+                }
+            }
+            saveRangeIndex(tableName, columns[i], field);
+        }
+    }
+
+    void saveRangeIndex(const std::string& tableName, const std::string& columnName, int field) {
+        std::string indexFile = getRangeIndexFile(tableName, columnName);
+        std::string tmpFile = indexFile + ".tmp";
+        std::ofstream outFile(tmpFile, std::ios::trunc);
+        const BPlusTree<IndexKey, int>& tree = rangeIndexes.at(tableName).at(field);
+        for (auto it = tree.begin(); it != tree.end(); ++it) {
+            outFile << it.value() << " " << it.key().toString() << "\n";
+        }
+        outFile.close();
+        fs::rename(tmpFile, indexFile);
+    }
+
+    void saveTombstones(const std::string& tableName) {
+        std::string tombstoneFile = getTombstoneFile(tableName);
+        std::string tmpFile = tombstoneFile + ".tmp";
+        std::ofstream outFile(tmpFile, std::ios::trunc);
+        for (const auto& [pk, segmentId] : tombstones.at(tableName)) {
+            outFile << pk << " " << segmentId << "\n";
+        }
+        outFile.close();
+        fs::rename(tmpFile, tombstoneFile);
+    }
+
+    bool isDeleted(const std::string& tableName, int pk) {
+        const std::unordered_map<int, int>& deleted = tombstones.at(tableName);
+        return deleted.find(pk) != deleted.end();
+    }
+
+    bool needsCompaction(const std::string& tableName, const SegmentInfo& segment) {
+        const std::vector<SegmentInfo>& segments = manifests.at(tableName).segments;
+        return segment.id != segments.back().id && segment.deadRows > 0
+            && segment.deadRows > schema.compaction_threshold * segment.rows;
+    }
+
+    void scheduleCompaction(const std::string& tableName) {
+        std::lock_guard<std::mutex> queueGuard(compactionMutex);
+        compactionQueue.insert(tableName);
+        compactionWake.notify_one();
+    }
+
+    void compactionLoop() {
+        std::unique_lock<std::mutex> queueLock(compactionMutex);
+        while (true) {
+            compactionWake.wait(queueLock, [this] { return stopping || !compactionQueue.empty(); });
+            if (stopping) {
+                return;
+            }
+            std::string tableName = *compactionQueue.begin();
+            compactionQueue.erase(compactionQueue.begin());
+            queueLock.unlock();
+            try {
+                compactTable(tableName);
+            } catch (const std::exception& ex) {
+                std::cerr << "Compaction failed for " << tableName << ": " << ex.what() << std::endl;
+            }
+            queueLock.lock();
+        }
+    }
+
+    // Сжимает запечатанные сегменты с большой долей удалённых строк. Соседние сегменты с
+    // удалёнными строками сливаются в один, пока живых строк не больше tuples_limit.
+    // Результат записывается в сегмент с новым номером на месте группы; сжатие вступает
+    // в силу одной записью манифеста, после чего удаляются файлы исходных сегментов.
+    void compactTable(const std::string& tableName) {
+        std::unique_lock<TableLock> guard = lockForWrite(tableName);
+
+        std::vector<SegmentInfo>& segments = manifests.at(tableName).segments;
+        std::unordered_map<int, int>& deleted = tombstones.at(tableName);
+        std::vector<SegmentInfo> compacted;
+        std::vector<int> rewritten;
+        std::vector<int> sources;
+        std::vector<int> purged; // отметки удалений снимаются только после записи манифеста
+        size_t sealedCount = segments.empty() ? 0 : segments.size() - 1;
+        SegmentFormat format = getFormat(tableName);
+        int nextId = nextSegmentId(segments);
+
+        try {
+            for (size_t i = 0; i < sealedCount;) {
+                if (!needsCompaction(tableName, segments[i])) {
+                    compacted.push_back(segments[i++]);
+                    continue;
+                }
+
+                size_t groupEnd = i;
+                int liveRows = 0;
+                while (groupEnd < sealedCount && segments[groupEnd].deadRows > 0
+                    && liveRows + segments[groupEnd].rows - segments[groupEnd].deadRows <= schema.tuples_limit) {
+                    liveRows += segments[groupEnd].rows - segments[groupEnd].deadRows;
+                    ++groupEnd;
+                }
+
+                // Отметка сбрасывается на диск до создания нового сегмента: по ней loadManifest
+                // удалит после сбоя либо недописанный новый сегмент, либо оставшиеся исходные
+                int mergedId = nextId++;
+                std::ofstream compactionFile(getCompactionFile(tableName), std::ios::app);
+                compactionFile << mergedId;
+                for (size_t j = i; j < groupEnd; ++j) {
+                    compactionFile << " " << segments[j].id;
+                    sources.push_back(segments[j].id);
+                }
+                compactionFile << "\n";
+                compactionFile.close();
+                syncFile(getCompactionFile(tableName));
+
+                SegmentWriter merged = openSegment(tableName, mergedId, true);
+                SegmentStats stats;
+                stats.columns.resize(schema.structure.at(tableName).size() + 1);
+                std::map<int, BloomFilter> blooms = newBloomFilters(tableName);
+                std::vector<std::string> values;
+                int appended = 0;
+                for (size_t j = i; j < groupEnd; ++j) {
+                    SegmentReader reader(getSegmentFile(tableName, segments[j].id), format);
+                    for (size_t row = 0; row < reader.rowCount(); ++row) {
+                        if (deleted.count(reader.pk(row)) != 0) {
+                            purged.push_back(reader.pk(row));
+                        } else {
+                            values.clear();
+                            for (size_t field = 1; field < reader.fieldCount(row); ++field) {
+                                values.emplace_back(reader.field(row, field));
+                            }
+                            merged.append(reader.pk(row), values);
+                            ++appended;
+                            stats.addRow(reader.pk(row), values);
+                            addToBlooms(blooms, values);
+                        }
+                    }
+                }
+
+                merged.seal();
+                merged.flush();
+                // Счётчики удалённых строк лишь оценка: судьба группы решается по записанным строкам
+                if (appended > 0) {
+                    // Исходные сегменты будут удалены, поэтому новый сбрасывается на диск до записи манифеста
+                    saveBloomFilters(tableName, mergedId, blooms);
+                    for (const std::string& file : merged.files()) {
+                        syncFile(file);
+                    }
+                    compacted.push_back({ mergedId, appended, merged.bytes(), 0, format == SegmentFormat::Binary, stats, blooms });
+                    rewritten.push_back(mergedId);
+                } else {
+                    removeSegment(tableName, mergedId);
+                }
+                i = groupEnd;
+            }
+        } catch (...) {
+            // Манифест не менялся: новые сегменты не нужны
+            for (int segmentId = nextSegmentId(segments); segmentId < nextId; ++segmentId) {
+                removeSegment(tableName, segmentId);
+            }
+            fs::remove(getCompactionFile(tableName));
+            throw;
+        }
+
+        if (!sources.empty()) {
+            compacted.push_back(segments.back());
+            segments = compacted;
+            saveManifest(tableName);
+            for (int pk : purged) {
+                deleted.erase(pk);
+            }
+            saveTombstones(tableName);
+
+            std::ofstream indexFile(getPkIndexFile(tableName), std::ios::app);
+            for (int segmentId : rewritten) {
+                indexSegment(tableName, segmentId, &indexFile);
+            }
+            indexFile.close();
+            for (int segmentId : sources) {
+                removeSegment(tableName, segmentId);
+            }
+            bumpVersion(tableName);
+        }
+        fs::remove(getCompactionFile(tableName));
+    }
+
+    void indexSegment(const std::string& tableName, int segmentId, std::ofstream* log) {
+        std::map<int, RowLocation>& index = pkIndexes.at(tableName);
+        SegmentReader reader(getSegmentFile(tableName, segmentId), getFormat(tableName));
+        for (size_t row = 0; row < reader.rowCount(); ++row) {
+            int pk = reader.pk(row);
+            if (isDeleted(tableName, pk)) {
+                continue;
+            }
+            RowLocation location{ segmentId, reader.offset(row) };
+            index[pk] = location;
+            if (log != nullptr) {
+                *log << pk << " " << location.segmentId << " " << location.offset << "\n";
+            }
+        }
     }
 
-    int getNextPrimaryKey(const std::string& tableName) {
+    // Ключи выдаются из памяти; файл последовательности хранит верхнюю границу
+    // зарезервированного блока и переписывается раз в pkReserveBlock ключей. Граница
+    // сохраняется на диск до выдачи ключей, поэтому после сбоя неиспользованный остаток
+    // блока пропускается, но ключи никогда не повторяются. Вызывается под блокировкой таблицы.
+    // Возвращает первый из count подряд идущих ключей.
+    int reservePrimaryKeys(const std::string& tableName, int count) {
+        PkRange& range = pkRanges.at(tableName);
+        if (range.limit - range.next >= count) {
+            range.next += count;
+            return range.next - count;
+        }
+
         std::string pkFile = getPrimaryKeyFile(tableName);
         int pk = 1;
 
@@ -48,24 +2159,64 @@ private:
             inFile.close();
         }
 
-        std::ofstream outFile(pkFile, std::ios::trunc);
-        outFile << pk + 1;
+        int reserved = std::max(count, pkReserveBlock);
+        std::string tmpFile = pkFile + ".tmp";
+        std::ofstream outFile(tmpFile, std::ios::trunc);
+        outFile << pk + reserved;
         outFile.close();
+        syncFile(tmpFile);
+        fs::rename(tmpFile, pkFile);
 
+        range.next = pk + count;
+        range.limit = pk + reserved;
         return pk;
     }
 
-    void lockTable(const std::string& tableName) {
-        std::string lockFile = getLockFile(tableName);
-        while (fs::exists(lockFile)) {
-            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    void appendToSegment(const std::string& tableName, int segmentId, const std::string& rows) {
+        std::ofstream file(getSegmentFile(tableName, segmentId), std::ios::app | std::ios::binary);
+        file << rows;
+        file.close();
+    }
+
+    TableLock& getTableLock(const std::string& tableName) {
+        return *tableLocks.at(tableName);
+    }
+
+    void loadTable(const std::string& tableName, bool reindexAll = false) {
+        removeTemporaryFiles(tableName);
+        std::set<int> changed = loadManifest(tableName);
+        loadBloomFilters(tableName);
+        loadTombstones(tableName);
+        loadPkIndex(tableName, reindexAll, changed);
+        fs::remove(getCompactionFile(tableName));
+        loadRangeIndexes(tableName, reindexAll);
+        tableVersions[tableName] = getTableLock(tableName).readVersion();
+    }
+
+    // Исключительная блокировка; если таблицу менял другой процесс, метаданные перечитываются
+    std::unique_lock<TableLock> lockForWrite(const std::string& tableName) {
+        std::unique_lock<TableLock> guard(getTableLock(tableName));
+        if (getTableLock(tableName).readVersion() != tableVersions.at(tableName)) {
+            loadTable(tableName);
+        }
+        return guard;
+    }
+
+    std::shared_lock<TableLock> lockForRead(const std::string& tableName) {
+        for (;;) {
+            std::shared_lock<TableLock> guard(getTableLock(tableName));
+            if (getTableLock(tableName).readVersion() == tableVersions.at(tableName)) {
+                return guard;
+            }
+            guard.unlock();
+            lockForWrite(tableName);
         }
-        std::ofstream(lockFile).close();
     }
 
-    void unlockTable(const std::string& tableName) {
-        std::string lockFile = getLockFile(tableName);
-        fs::remove(lockFile);
+    // Вызывается писателем перед снятием блокировки
+    void bumpVersion(const std::string& tableName) {
+        uint64_t& version = tableVersions.at(tableName);
+        getTableLock(tableName).writeVersion(++version);
     }
 
 public:
@@ -81,189 +2232,987 @@ public:
                 pkFile << 1;
                 pkFile.close();
             }
+            tableLocks[tableName] = std::make_unique<TableLock>(getLockFile(tableName));
+            pkRanges[tableName] = PkRange();
+        }
+
+        // Таблицы, упомянутые в журнале, индексируются полностью: после сбоя в индексы могли
+        // не попасть строки любого из недавно записанных сегментов
+        wal = std::make_unique<WriteAheadLog>(schema.name + "/wal");
+        std::vector<WalRecord> records = wal->read();
+        std::set<std::string> logged;
+        for (const WalRecord& record : records) {
+            logged.insert(record.tableName);
+        }
+        for (const auto& [tableName, columns] : schema.structure) {
+            std::unique_lock<TableLock> guard(getTableLock(tableName));
+            loadTable(tableName, logged.count(tableName) != 0);
+        }
+        if (!records.empty()) {
+            replayLog(records);
+            checkpoint();
+        }
+
+        compactor = std::thread(&Database::compactionLoop, this);
+        checkpointer = std::thread(&Database::checkpointLoop, this);
+        for (const auto& [tableName, manifest] : manifests) {
+            for (const SegmentInfo& segment : manifest.segments) {
+                if (needsCompaction(tableName, segment)) {
+                    scheduleCompaction(tableName);
+                    break;
+                }
+            }
+        }
+    }
+
+    ~Database() {
+        {
+            std::lock_guard<std::mutex> checkpointGuard(checkpointMutex);
+            checkpointStopping = true;
+        }
+        checkpointWake.notify_one();
+        checkpointer.join();
+        {
+            std::lock_guard<std::mutex> queueGuard(compactionMutex);
+            stopping = true;
+        }
+        compactionWake.notify_one();
+        compactor.join();
+
+        // При штатном завершении журнал остаётся пустым
+        try {
+            checkpoint();
+        } catch (const std::exception& ex) {
+            std::cerr << "Checkpoint failed: " << ex.what() << std::endl;
+        }
+    }
+
+    void insertInto(const std::string& tableName, const std::vector<std::string>& values) {
+        insertMany(tableName, { values });
+    }
+
+    // Пакетная вставка: одна блокировка, один резерв ключей, одна запись на сегмент и один
+    // fsync журнала (общий с одновременными вставками и удалениями других потоков).
+    void insertMany(const std::string& tableName, const std::vector<std::vector<std::string>>& rows) {
+        if (schema.structure.find(tableName) == schema.structure.end()) {
+            throw std::runtime_error("Table does not exist: " + tableName);
+        }
+        if (rows.empty()) {
+            return;
+        }
+
+        std::unique_lock<TableLock> guard = lockForWrite(tableName);
+
+        int pk = reservePrimaryKeys(tableName, static_cast<int>(rows.size()));
+        std::string records;
+        for (size_t i = 0; i < rows.size(); ++i) {
+            WriteAheadLog::encode(WalRecord::Type::Insert, tableName, pk + static_cast<int>(i), rows[i], records);
+        }
+        uint64_t sequence = wal->append(records);
+        bool compact = applyInsert(tableName, pk, rows);
+        bumpVersion(tableName);
+        guard.unlock();
+
+        commitLog(sequence);
+        if (compact) {
+            scheduleCompaction(tableName);
+        }
+    }
+
+    void deleteFrom(const std::string& tableName, int pk) {
+        if (schema.structure.find(tableName) == schema.structure.end()) {
+            throw std::runtime_error("Table does not exist: " + tableName);
+        }
+
+        std::unique_lock<TableLock> guard = lockForWrite(tableName);
+        if (pkIndexes.at(tableName).count(pk) == 0) {
+            return;
+        }
+        std::string record;
+        WriteAheadLog::encode(WalRecord::Type::Delete, tableName, pk, {}, record);
+        uint64_t sequence = wal->append(record);
+        bool compact = applyDelete(tableName, pk);
+        bumpVersion(tableName);
+        guard.unlock();
+
+        commitLog(sequence);
+        if (compact) {
+            scheduleCompaction(tableName);
+        }
+    }
+
+private:
+    // Записывает строки с ключами firstPk, firstPk + 1, ... в файлы таблицы. fsync делается
+    // только для заполненного сегмента, перед тем как хвостовым станет новый: восстановление
+    // после сбоя проверяет лишь хвост. Строки копятся в SegmentWriter и сбрасываются в файл
+    // при заполнении хвостового сегмента.
+    // Вызывается под исключительной блокировкой; возвращает true, если нужно сжатие.
+    bool applyInsert(const std::string& tableName, int firstPk, const std::vector<std::vector<std::string>>& rows) {
+        int pk = firstPk;
+        TableManifest& manifest = manifests.at(tableName);
+        std::map<int, RowLocation>& index = pkIndexes.at(tableName);
+        std::unique_ptr<SegmentWriter> writer; // хвостовой сегмент
+        std::ostringstream indexLog;
+        std::map<int, BPlusTree<IndexKey, int>>& ranges = rangeIndexes.at(tableName);
+        std::map<int, std::string> rangeLogs; // номер поля -> строки "pk значение"
+        bool compact = false;
+
+        for (const std::vector<std::string>& values : rows) {
+            // Вставка всегда идёт в хвостовой сегмент; новый сегмент открывается, когда хвост заполнен.
+            // Заполненный двоичный сегмент перед этим запечатывается подвалом.
+            if (manifest.segments.empty() || manifest.segments.back().rows >= schema.tuples_limit
+                || manifest.segments.back().sealed) {
+                if (writer) {
+                    writer->flush();
+                }
+                if (!manifest.segments.empty()) {
+                    SegmentInfo& full = manifest.segments.back();
+                    sealSegment(tableName, full);
+                    saveBloomFilters(tableName, full.id, full.blooms);
+                    for (const std::string& file : segmentFiles(getSegmentFile(tableName, full.id), getFormat(tableName), schema.structure.at(tableName).size())) {
+                        syncFile(file);
+                    }
+                }
+                int segmentId = nextSegmentId(manifest.segments);
+                writer = std::make_unique<SegmentWriter>(openSegment(tableName, segmentId, true));
+                writer->flush();
+                manifest.segments.push_back({ segmentId, 0, writer->bytes() });
+                manifest.segments.back().stats.columns.resize(schema.structure.at(tableName).size() + 1);
+                manifest.segments.back().blooms = newBloomFilters(tableName);
+                saveManifest(tableName);
+                compact = compact || (manifest.segments.size() > 1
+                    && needsCompaction(tableName, manifest.segments[manifest.segments.size() - 2]));
+            } else if (!writer) {
+                writer = std::make_unique<SegmentWriter>(openSegment(tableName, manifest.segments.back().id, false));
+            }
+
+            SegmentInfo& tail = manifest.segments.back();
+            std::uintmax_t offset = writer->nextOffset();
+            writer->append(pk, values);
+            tail.stats.addRow(pk, values);
+            addToBlooms(tail.blooms, values);
+
+            index[pk] = { tail.id, offset };
+            indexLog << pk << " " << tail.id << " " << offset << "\n";
+            for (auto& [field, tree] : ranges) {
+                std::string_view value = static_cast<size_t>(field) <= values.size() ? std::string_view(values[field - 1]) : std::string_view();
+                tree.insert(IndexKey::from(value), pk);
+                rangeLogs[field].append(std::to_string(pk)).append(" ").append(value).append("\n");
+            }
+            tail.rows++;
+            tail.bytes = writer->bytes();
+            pk++;
+        }
+        writer->flush();
+
+        std::ofstream indexFile(getPkIndexFile(tableName), std::ios::app);
+        indexFile << indexLog.str();
+        indexFile.close();
+        for (const auto& [field, log] : rangeLogs) {
+            std::ofstream rangeFile(getRangeIndexFile(tableName, schema.structure.at(tableName)[field - 1]), std::ios::app);
+            rangeFile << log;
+        }
+        return compact;
+    }
+
+    // Строка не переписывается сразу: в журнал удалений добавляется отметка,
+    // а сам сегмент позже переписывает фоновое сжатие. Вызывается под исключительной
+    // блокировкой для существующего pk; возвращает true, если нужно сжатие.
+    bool applyDelete(const std::string& tableName, int pk) {
+        std::map<int, RowLocation>& index = pkIndexes.at(tableName);
+        auto it = index.find(pk);
+        int segmentId = it->second.segmentId;
+        index.erase(it);
+        tombstones.at(tableName)[pk] = segmentId;
+        SegmentInfo& segment = findSegment(tableName, segmentId);
+        segment.deadRows++;
+
+        std::ofstream tombstoneFile(getTombstoneFile(tableName), std::ios::app);
+        tombstoneFile << pk << " " << segmentId << "\n";
+        tombstoneFile.close();
+        std::ofstream indexFile(getPkIndexFile(tableName), std::ios::app);
+        indexFile << pk << " 0 0\n";
+        indexFile.close();
+        return needsCompaction(tableName, segment);
+    }
+
+    // Ждёт записи изменений в журнал на диске; при большом журнале будит контрольную точку
+    void commitLog(uint64_t sequence) {
+        wal->commit(sequence);
+        if (wal->size() >= walCheckpointBytes) {
+            std::lock_guard<std::mutex> checkpointGuard(checkpointMutex);
+            checkpointRequested = true;
+            checkpointWake.notify_one();
+        }
+    }
+
+    // Проигрывает журнал после сбоя. Изменения, уже попавшие в файлы таблиц, пропускаются:
+    // вставка — если строка pk в файлах совпадает с записью или pk среди удалённых, удаление —
+    // если pk нет в индексе. Несовпадающая строка может быть только в хвостовом сегменте
+    // (заполненные сбрасываются на диск): хвост обрезается перед ней, и она вместе со
+    // следующими строками вставляется заново по журналу.
+    void replayLog(const std::vector<WalRecord>& records) {
+        std::map<std::string, std::map<int, std::unique_ptr<SegmentReader>>> readers;
+        for (const WalRecord& record : records) {
+            const std::string& tableName = record.tableName;
+            if (schema.structure.find(tableName) == schema.structure.end()) {
+                continue;
+            }
+            std::unique_lock<TableLock> guard = lockForWrite(tableName);
+            bool present = pkIndexes.at(tableName).count(record.pk) != 0;
+            bool compact = false;
+            if (record.type == WalRecord::Type::Insert) {
+                if (isDeleted(tableName, record.pk)
+                    || (present && storedRowMatches(tableName, record, readers[tableName]))) {
+                    continue;
+                }
+                readers.erase(tableName);
+                if (present) {
+                    truncateTail(tableName, record.pk);
+                }
+                compact = applyInsert(tableName, record.pk, { record.values });
+            } else {
+                if (!present) {
+                    continue;
+                }
+                compact = applyDelete(tableName, record.pk);
+            }
+            bumpVersion(tableName);
+            if (compact) {
+                scheduleCompaction(tableName);
+            }
+        }
+    }
+
+    // Строка pk в файлах таблицы совпадает со вставкой из журнала. Повреждённая строка
+    // (например, с нулями вместо недописанной страницы) считается несовпадающей.
+    bool storedRowMatches(const std::string& tableName, const WalRecord& record,
+        std::map<int, std::unique_ptr<SegmentReader>>& readers) {
+        const RowLocation& location = pkIndexes.at(tableName).at(record.pk);
+        std::vector<std::string_view> fields;
+        try {
+            std::unique_ptr<SegmentReader>& reader = readers[location.segmentId];
+            if (!reader) {
+                reader = std::make_unique<SegmentReader>(getSegmentFile(tableName, location.segmentId), getFormat(tableName), false);
+            }
+            reader->fieldsAt(location.offset, fields);
+        } catch (const std::exception&) {
+            return false;
+        }
+        if (fields.size() < record.values.size() + 1 || fields[0] != std::to_string(record.pk)) {
+            return false;
+        }
+        for (size_t i = 1; i < fields.size(); ++i) {
+            if (fields[i] != (i <= record.values.size() ? std::string_view(record.values[i - 1]) : std::string_view())) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Переписывает хвостовой сегмент без строки pk и всех строк после неё и перечитывает таблицу
+    void truncateTail(const std::string& tableName, int pk) {
+        const RowLocation location = pkIndexes.at(tableName).at(pk);
+        const SegmentInfo& tail = manifests.at(tableName).segments.back();
+        if (location.segmentId != tail.id) {
+            throw std::runtime_error("Log record does not match sealed segment " + std::to_string(location.segmentId)
+                + " of table " + tableName);
+        }
+        std::vector<int> pks;
+        std::vector<std::vector<std::string>> rows;
+        {
+            SegmentReader reader(getSegmentFile(tableName, tail.id), getFormat(tableName));
+            for (size_t row = 0; row < reader.rowCount() && reader.offset(row) != location.offset; ++row) {
+                pks.push_back(reader.pk(row));
+                std::vector<std::string>& values = rows.emplace_back();
+                for (size_t field = 1; field < reader.fieldCount(row); ++field) {
+                    values.emplace_back(reader.field(row, field));
+                }
+            }
+        }
+        SegmentWriter writer = openSegment(tableName, tail.id, true);
+        for (size_t i = 0; i < rows.size(); ++i) {
+            writer.append(pks[i], rows[i]);
+        }
+        writer.flush();
+        loadTable(tableName, true);
+    }
+
+    // Контрольная точка: файлы таблиц, которые пишутся без fsync, сбрасываются на диск, после
+    // чего журнал очищается. Разделяемая блокировка таблицы гарантирует, что её изменения,
+    // уже записанные в журнал, применены к файлам.
+    void checkpoint() {
+        wal->checkpoint([this] {
+            for (const auto& [tableName, columns] : schema.structure) {
+                std::shared_lock<TableLock> guard = lockForRead(tableName);
+                for (const std::string& file : getUnsyncedFiles(tableName)) {
+                    syncFile(file);
+                }
+                syncFile(getTableDir(tableName));
+            }
+        });
+    }
+
+    // Файлы, которые могут отставать от журнала: хвостовой сегмент и журналы индексов и удалений.
+    // Заполненные сегменты, фильтры Блума и манифест сбрасываются на диск при записи.
+    std::vector<std::string> getUnsyncedFiles(const std::string& tableName) {
+        std::vector<std::string> files = { getPkIndexFile(tableName), getTombstoneFile(tableName) };
+        const std::vector<SegmentInfo>& segments = manifests.at(tableName).segments;
+        if (!segments.empty()) {
+            for (const std::string& file : segmentFiles(getSegmentFile(tableName, segments.back().id), getFormat(tableName), schema.structure.at(tableName).size())) {
+                files.push_back(file);
+            }
+        }
+        for (const auto& [field, tree] : rangeIndexes.at(tableName)) {
+            files.push_back(getRangeIndexFile(tableName, schema.structure.at(tableName)[field - 1]));
+        }
+        return files;
+    }
+
+    void checkpointLoop() {
+        std::unique_lock<std::mutex> checkpointLock(checkpointMutex);
+        while (true) {
+            checkpointWake.wait(checkpointLock, [this] { return checkpointStopping || checkpointRequested; });
+            if (checkpointStopping) {
+                return;
+            }
+            checkpointRequested = false;
+            checkpointLock.unlock();
+            try {
+                checkpoint();
+            } catch (const std::exception& ex) {
+                std::cerr << "Checkpoint failed: " << ex.what() << std::endl;
+            }
+            checkpointLock.lock();
+        }
+    }
+
+public:
+
+    QueryPlan compileSelect(const std::string& tableName, const std::map<std::string, std::string>& conditions) {
+        std::vector<Condition> equalities;
+        for (const auto& [column, value] : conditions) {
+            equalities.push_back({ column, CompareOp::Equal, value });
+        }
+        return compileSelect(tableName, equalities);
+    }
+
+    // Строит план для условий вида столбец <op> значение и сортировки ORDER BY. Разрешение
+    // столбцов кешируется по форме запроса, так что повторные запросы с другими значениями его не повторяют.
+    QueryPlan compileSelect(const std::string& tableName, const std::vector<Condition>& conditions,
+        const std::string& orderBy = "", bool descending = false) {
+        if (schema.structure.find(tableName) == schema.structure.end()) {
+            throw std::runtime_error("Table does not exist: " + tableName);
+        }
+
+        std::string shape = tableName;
+        for (const Condition& condition : conditions) {
+            shape.append(1, '\0').append(condition.column).append(1, static_cast<char>('0' + static_cast<int>(condition.op)));
+        }
+        shape.append(1, '\0').append(orderBy);
+
+        QueryPlan plan;
+        {
+            std::lock_guard<std::mutex> cacheGuard(planCacheMutex);
+            auto cached = planCache.find(shape);
+            if (cached == planCache.end()) {
+                QueryPlan resolved;
+                resolved.tableName = tableName;
+                for (const Condition& condition : conditions) {
+                    int colIndex = getColumnIndex(tableName, condition.column);
+                    if (colIndex == -1) {
+                        resolved.neverMatches = true;
+                    }
+                    resolved.predicates.push_back({ colIndex, "", fieldMatcher(condition.op), condition.op });
+                }
+                if (!orderBy.empty()) {
+                    resolved.orderColumn = getColumnIndex(tableName, orderBy);
+                    if (resolved.orderColumn == -1) {
+                        throw std::runtime_error("Column does not exist: " + orderBy);
+                    }
+                }
+                cached = planCache.emplace(shape, resolved).first;
+            }
+            plan = cached->second;
+        }
+
+        for (size_t i = 0; i < conditions.size(); ++i) {
+            plan.predicates[i].value = conditions[i].value;
         }
+        plan.descending = descending;
+        return plan;
+    }
+
+    void select(const std::string& tableName, const std::map<std::string, std::string>& conditions) {
+        select(compileSelect(tableName, conditions));
     }
 
-    void insertInto(const std::string& tableName, const std::vector<std::string>& values) {
+    void select(const QueryPlan& plan, ScanMode mode = ScanMode::Sequential) {
+        StreamSink sink(std::cout);
+        select(plan, mode, sink);
+    }
+
+    void select(const QueryPlan& plan, ScanMode mode, ResultSink& sink) {
+        const std::string& tableName = plan.tableName;
         if (schema.structure.find(tableName) == schema.structure.end()) {
             throw std::runtime_error("Table does not exist: " + tableName);
         }
+        if (plan.neverMatches) {
+            return;
+        }
 
-        lockTable(tableName);
+        std::shared_lock<TableLock> guard = lockForRead(tableName);
+        const std::vector<SegmentInfo>& segments = manifests.at(tableName).segments;
 
-        std::string tableDir = getTableDir(tableName);
-        int pk = getNextPrimaryKey(tableName);
-        std::string newRow = std::to_string(pk) + "," + join(values, ",");
+        // С ORDER BY или с условием по столбцу с B+деревом результат собирается целиком
+        // в selectOrdered; режим сканирования в этом случае не используется
+        const std::map<int, BPlusTree<IndexKey, int>>& ranges = rangeIndexes.at(tableName);
+        if (plan.orderColumn != -1 || std::any_of(plan.predicates.begin(), plan.predicates.end(),
+            [&](const Predicate& predicate) { return ranges.count(predicate.column) != 0; })) {
+            selectOrdered(plan, sink);
+            return;
+        }
 
-        for (int fileIndex = 1;; ++fileIndex) {
-            std::string fileName = tableDir + "/" + std::to_string(fileIndex) + ".csv";
-            if (!fs::exists(fileName)) {
-                std::ofstream file(fileName);
-                file << tableName + "_pk," + join(schema.structure[tableName], ",") << "\n";
-                file << newRow << "\n";
-                break;
+        if (mode == ScanMode::Sequential) {
+            std::string output;
+            for (const SegmentInfo& segment : segments) {
+                scanSegment(plan, segment, output);
+                sink.writeRows(output);
             }
+            sink.flush();
+            return;
+        }
 
-            std::ifstream file(fileName);
-            int lineCount = std::count(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>(), '\n');
-            file.close();
-
-            if (lineCount < schema.tuples_limit + 1) {
-                std::ofstream file(fileName, std::ios::app);
-                file << newRow << "\n";
-                break;
+        // Задачи ссылаются на локальные переменные, sink и сегменты под блокировкой таблицы,
+        // поэтому при ошибке select выходит только после завершения всех отправленных задач
+        ThreadPool& pool = getScanPool();
+        if (mode == ScanMode::ParallelUnordered) {
+            std::mutex outputMutex;
+            std::vector<std::future<void>> pending;
+            for (const SegmentInfo& segment : segments) {
+                pending.push_back(pool.submit([&] {
+                    std::string output;
+                    scanSegment(plan, segment, output);
+                    std::lock_guard<std::mutex> outputGuard(outputMutex);
+                    sink.writeRows(output);
+                }));
             }
+            for (std::future<void>& task : pending) {
+                task.wait();
+            }
+            for (std::future<void>& task : pending) {
+                task.get();
+            }
+            sink.flush();
+            return;
         }
 
-        unlockTable(tableName);
+        // Упорядоченный режим: в работе не больше двух сегментов на поток, результаты
+        // выводятся строго в порядке сегментов по мере готовности самого старого
+        size_t window = pool.size() * 2;
+        std::vector<std::string> outputs(segments.size());
+        std::queue<std::future<void>> pending;
+        size_t next = 0;
+        size_t printed = 0;
+        try {
+            while (printed < segments.size()) {
+                while (next < segments.size() && pending.size() < window) {
+                    pending.push(pool.submit([&, next] { scanSegment(plan, segments[next], outputs[next]); }));
+                    ++next;
+                }
+                std::future<void> task = std::move(pending.front());
+                pending.pop();
+                task.get();
+                sink.writeRows(outputs[printed]);
+                std::string().swap(outputs[printed]);
+                ++printed;
+            }
+        } catch (...) {
+            for (; !pending.empty(); pending.pop()) {
+                pending.front().wait();
+            }
+            throw;
+        }
+        sink.flush();
     }
 
-    void deleteFrom(const std::string& tableName, int pk) {
+    // Строит B+дерево по столбцу и сохраняет его файлом в каталоге таблицы
+    void createIndex(const std::string& tableName, const std::string& columnName) {
         if (schema.structure.find(tableName) == schema.structure.end()) {
             throw std::runtime_error("Table does not exist: " + tableName);
         }
+        int field = getColumnIndex(tableName, columnName);
+        if (field < 1) {
+            throw std::runtime_error("Column does not exist: " + columnName);
+        }
 
-        lockTable(tableName);
-
-        std::string tableDir = getTableDir(tableName);
-        for (int fileIndex = 1;; ++fileIndex) {
-            std::string fileName = tableDir + "/" + std::to_string(fileIndex) + ".csv";
-            if (!fs::exists(fileName)) {
-                break;
-            }
-
-            std::ifstream inFile(fileName);
-            std::string line;
-            std::vector<std::string> rows;
+        std::unique_lock<TableLock> guard = lockForWrite(tableName);
+        std::map<int, BPlusTree<IndexKey, int>>& indexes = rangeIndexes.at(tableName);
+        if (indexes.count(field)) {
+            throw std::runtime_error("Index already exists: " + tableName + "(" + columnName + ")");
+        }
 
-            while (std::getline(inFile, line)) {
-                if (!line.empty() && std::stoi(line.substr(0, line.find(','))) != pk) {
-                    rows.push_back(line);
+        BPlusTree<IndexKey, int>& tree = indexes[field];
+        for (const SegmentInfo& segment : manifests.at(tableName).segments) {
+            SegmentReader reader(getSegmentFile(tableName, segment.id), getFormat(tableName));
+            for (size_t row = 0; row < reader.rowCount(); ++row) {
+                int pk = reader.pk(row);
+                if (segment.deadRows > 0 && isDeleted(tableName, pk)) {
+                    continue;
                 }
+                std::string_view value = static_cast<size_t>(field) < reader.fieldCount(row) ? reader.field(row, field) : std::string_view();
+                tree.insert(IndexKey::from(value), pk);
             }
-            inFile.close();
-
-            std::ofstream outFile(fileName, std::ios::trunc);
-            for (const std::string& row : rows) {
-                outFile << row << "\n";
-            }
-            outFile.close();
         }
+        saveRangeIndex(tableName, columnName, field);
+        bumpVersion(tableName);
+    }
 
-        unlockTable(tableName);
+    // Точечный поиск по первичному ключу через индекс, без сканирования сегментов
+    void selectByPk(const std::string& tableName, int pk) {
+        StreamSink sink(std::cout);
+        selectByPk(tableName, pk, sink);
     }
 
-    void select(const std::string& tableName, const std::map<std::string, std::string>& conditions) {
+    void selectByPk(const std::string& tableName, int pk, ResultSink& sink) {
         if (schema.structure.find(tableName) == schema.structure.end()) {
             throw std::runtime_error("Table does not exist: " + tableName);
         }
 
-        std::string tableDir = getTableDir(tableName);
+        std::shared_lock<TableLock> guard = lockForRead(tableName);
 
-        for (int fileIndex = 1;; ++fileIndex) {
-            std::string fileName = tableDir + "/" + std::to_string(fileIndex) + ".csv";
-            if (!fs::exists(fileName)) {
-                break;
-            }
+        const std::map<int, RowLocation>& index = pkIndexes.at(tableName);
+        auto it = index.find(pk);
+        if (it == index.end()) {
+            return;
+        }
 
-            std::ifstream inFile(fileName);
-            std::string line;
-            std::getline(inFile, line); // Пропускаем заголовок
-            while (std::getline(inFile, line)) {
-                std::vector<std::string> row = split(line, ',');
-
-                bool matches = true;
-                for (const auto& [column, value] : conditions) {
-                    int colIndex = getColumnIndex(tableName, column);
-                    if (colIndex == -1 || row[colIndex] != value) {
-                        matches = false;
-                        break;
-                    }
+        SegmentReader reader(getSegmentFile(tableName, it->second.segmentId), getFormat(tableName), false);
+        std::string row;
+        reader.appendRowAt(it->second.offset, row);
+        sink.writeRow(row);
+        sink.flush();
+    }
+
+    void crossJoin(const std::string& table1, const std::string& table2) {
+        StreamSink sink(std::cout);
+        crossJoin(table1, table2, sink);
+    }
+
+    void crossJoin(const std::string& table1, const std::string& table2, ResultSink& sink) {
+        if (schema.structure.find(table1) == schema.structure.end()) {
+            throw std::runtime_error("Table does not exist: " + table1);
+        }
+        if (schema.structure.find(table2) == schema.structure.end()) {
+            throw std::runtime_error("Table does not exist: " + table2);
+        }
+
+        std::shared_lock<TableLock> guard1 = lockForRead(table1);
+        std::shared_lock<TableLock> guard2;
+        if (table2 != table1) {
+            guard2 = lockForRead(table2);
+        }
+
+        sink.writeRow(table1 + "_pk," + join(schema.structure.at(table1), ",") + ","
+            + table2 + "_pk," + join(schema.structure.at(table2), ","));
+
+        // Блочный вложенный цикл: в памяти держится не больше crossJoinBlockRows строк
+        // внешней таблицы, внутренняя перечитывается с диска для каждого блока
+        std::string outerBlock;
+        std::vector<std::pair<size_t, size_t>> outerRows;
+        std::string output;
+        for (const SegmentInfo& segment : manifests.at(table1).segments) {
+            SegmentReader reader(getSegmentFile(table1, segment.id), getFormat(table1));
+            for (size_t row = 0; row < reader.rowCount(); ++row) {
+                if (segment.deadRows > 0 && isDeleted(table1, reader.pk(row))) {
+                    continue;
                 }
-                if (matches) {
-                    std::cout << line << "\n";
+                size_t start = outerBlock.size();
+                reader.appendRow(row, outerBlock);
+                outerRows.emplace_back(start, outerBlock.size() - start);
+                if (outerRows.size() == crossJoinBlockRows) {
+                    crossJoinBlock(table2, outerBlock, outerRows, output, sink);
+                    outerBlock.clear();
+                    outerRows.clear();
                 }
             }
-            inFile.close();
         }
+        if (!outerRows.empty()) {
+            crossJoinBlock(table2, outerBlock, outerRows, output, sink);
+        }
+        sink.flush();
     }
 
-    void crossJoin(const std::string& table1, const std::string& table2) {
+    // Статистика для клиентов библиотеки (в языке запросов не используется): оценка числа
+    // различных значений столбца (или <таблица>_pk) по скетчам HyperLogLog сводок сегментов.
+    // Значения удалённых, но ещё не сжатых строк тоже учитываются.
+    double distinctCount(const std::string& tableName, const std::string& columnName) {
+        if (schema.structure.find(tableName) == schema.structure.end()) {
+            throw std::runtime_error("Table does not exist: " + tableName);
+        }
+        int field = getColumnIndex(tableName, columnName);
+        if (field == -1) {
+            throw std::runtime_error("Column does not exist: " + tableName + "." + columnName);
+        }
+
+        std::shared_lock<TableLock> guard = lockForRead(tableName);
+        ColumnStats merged;
+        for (const SegmentInfo& segment : manifests.at(tableName).segments) {
+            if (static_cast<size_t>(field) < segment.stats.columns.size()) {
+                merged.merge(segment.stats.columns[field]);
+            }
+        }
+        return merged.distinctEstimate();
+    }
+
+    // Эквисоединение table1.column1 = table2.column2. Хеш-таблица строится по меньшей
+    // таблице (её сегменты остаются отображёнными в память на время соединения), бо́льшая
+    // читается посегментно. Без условия равенства выполняется crossJoin.
+    void hashJoin(const std::string& table1, const std::string& table2,
+        const std::string& column1, const std::string& column2) {
+        StreamSink sink(std::cout);
+        hashJoin(table1, table2, column1, column2, sink);
+    }
+
+    void hashJoin(const std::string& table1, const std::string& table2,
+        const std::string& column1, const std::string& column2, ResultSink& sink) {
+        if (column1.empty() || column2.empty()) {
+            crossJoin(table1, table2, sink);
+            return;
+        }
         if (schema.structure.find(table1) == schema.structure.end()) {
             throw std::runtime_error("Table does not exist: " + table1);
         }
         if (schema.structure.find(table2) == schema.structure.end()) {
             throw std::runtime_error("Table does not exist: " + table2);
         }
+        int colIndex1 = getColumnIndex(table1, column1);
+        int colIndex2 = getColumnIndex(table2, column2);
+        if (colIndex1 == -1) {
+            throw std::runtime_error("Column does not exist: " + table1 + "." + column1);
+        }
+        if (colIndex2 == -1) {
+            throw std::runtime_error("Column does not exist: " + table2 + "." + column2);
+        }
+
+        std::shared_lock<TableLock> guard1 = lockForRead(table1);
+        std::shared_lock<TableLock> guard2;
+        if (table2 != table1) {
+            guard2 = lockForRead(table2);
+        }
 
-        std::vector<std::vector<std::string>> rows1 = readAllRows(table1);
-        std::vector<std::vector<std::string>> rows2 = readAllRows(table2);
+        bool buildFirst = liveRowCount(table1) <= liveRowCount(table2);
+        const std::string& buildTable = buildFirst ? table1 : table2;
+        const std::string& probeTable = buildFirst ? table2 : table1;
+        int buildColumn = buildFirst ? colIndex1 : colIndex2;
+        int probeColumn = buildFirst ? colIndex2 : colIndex1;
 
-        std::vector<std::string> headers1 = schema.structure[table1];
-        std::vector<std::string> headers2 = schema.structure[table2];
+        // Значение столбца -> сегмент и номер строки в нём
+        std::vector<std::unique_ptr<SegmentReader>> buildSegments;
+        std::unordered_multimap<std::string_view, std::pair<const SegmentReader*, size_t>> hashTable;
+        for (const SegmentInfo& segment : manifests.at(buildTable).segments) {
+            const SegmentReader& reader = *buildSegments.emplace_back(
+                std::make_unique<SegmentReader>(getSegmentFile(buildTable, segment.id), getFormat(buildTable)));
+            for (size_t row = 0; row < reader.rowCount(); ++row) {
+                if (segment.deadRows > 0 && isDeleted(buildTable, reader.pk(row))) {
+                    continue;
+                }
+                if (buildColumn < static_cast<int>(reader.fieldCount(row))) {
+                    hashTable.emplace(reader.field(row, buildColumn), std::make_pair(&reader, row));
+                }
+            }
+        }
 
-        std::cout << table1 + "_pk," + join(headers1, ",") + "," + table2 + "_pk," + join(headers2, ",") << "\n";
+        sink.writeRow(table1 + "_pk," + join(schema.structure.at(table1), ",") + ","
+            + table2 + "_pk," + join(schema.structure.at(table2), ","));
 
-        for (const auto& row1 : rows1) {
-            for (const auto& row2 : rows2) {
-                std::cout << join(row1, ",") + "," + join(row2, ",") << "\n";
+        std::string output;
+        std::string probeRow;
+        std::string buildRow;
+        for (const SegmentInfo& segment : manifests.at(probeTable).segments) {
+            SegmentReader reader(getSegmentFile(probeTable, segment.id), getFormat(probeTable));
+            for (size_t row = 0; row < reader.rowCount(); ++row) {
+                if (probeColumn >= static_cast<int>(reader.fieldCount(row))) {
+                    continue;
+                }
+                auto [first, last] = hashTable.equal_range(reader.field(row, probeColumn));
+                if (first == last || (segment.deadRows > 0 && isDeleted(probeTable, reader.pk(row)))) {
+                    continue;
+                }
+                probeRow.clear();
+                reader.appendRow(row, probeRow);
+                for (auto it = first; it != last; ++it) {
+                    buildRow.clear();
+                    it->second.first->appendRow(it->second.second, buildRow);
+                    output.assign(buildFirst ? buildRow : probeRow).append(",").append(buildFirst ? probeRow : buildRow);
+                    sink.writeRow(output);
+                }
             }
         }
+        sink.flush();
     }
 
 private:
-    std::string join(const std::vector<std::string>& parts, const std::string& delimiter) {
-        std::ostringstream oss;
-        for (size_t i = 0; i < parts.size(); ++i) {
-            oss << parts[i];
-            if (i != parts.size() - 1) {
-                oss << delimiter;
+    // Сканирует один сегмент и дописывает подходящие строки в output (предварительно очищая его).
+    // Вызывается под разделяемой блокировкой таблицы, в том числе из потоков пула.
+    void scanSegment(const QueryPlan& plan, const SegmentInfo& segment, std::string& output) {
+        const std::string& tableName = plan.tableName;
+        output.clear();
+        if (!segmentMayMatch(plan, segment)) {
+            return;
+        }
+        SegmentReader reader(getSegmentFile(tableName, segment.id), getFormat(tableName));
+
+        for (size_t row = 0; row < reader.rowCount(); ++row) {
+            if (segment.deadRows > 0 && isDeleted(tableName, reader.pk(row))) {
+                continue;
+            }
+            if (rowMatches(plan, reader, row)) {
+                reader.appendRow(row, output);
+                output.push_back('\n');
             }
         }
-        return oss.str();
     }
 
-    std::vector<std::string> split(const std::string& str, char delimiter) {
-        std::vector<std::string> parts;
-        std::istringstream iss(str);
-        std::string part;
-        while (std::getline(iss, part, delimiter)) {
-            parts.push_back(part);
+    static bool rowMatches(const QueryPlan& plan, const SegmentReader& reader, size_t row) {
+        size_t fieldCount = reader.fieldCount(row);
+        for (const Predicate& predicate : plan.predicates) {
+            if (static_cast<size_t>(predicate.column) >= fieldCount
+                || !predicate.matches(reader.field(row, predicate.column), predicate.value)) {
+                return false;
+            }
         }
-        return parts;
+        return true;
     }
 
-    std::vector<std::vector<std::string>> readAllRows(const std::string& tableName) {
-        std::vector<std::vector<std::string>> rows;
-        std::string tableDir = getTableDir(tableName);
+    // Проверка по сводке и фильтрам Блума сегмента: false, если ни одна его строка не может
+    // пройти условия. Равенство сравнивает строки, но равные строки дают равные IndexKey,
+    // так что границы сводки годятся и для него.
+    bool segmentMayMatch(const QueryPlan& plan, const SegmentInfo& segment) {
+        const std::vector<ColumnStats>& columns = segment.stats.columns;
+        for (const Predicate& predicate : plan.predicates) {
+            if (predicate.op == CompareOp::Equal) {
+                auto bloom = segment.blooms.find(predicate.column);
+                if (bloom != segment.blooms.end() && !bloom->second.mayContain(predicate.value)) {
+                    return false;
+                }
+            }
+            if (static_cast<size_t>(predicate.column) >= columns.size()) {
+                continue;
+            }
+            const ColumnStats& stats = columns[predicate.column];
+            if (!stats.hasValues) {
+                return false;
+            }
+            IndexKey key = IndexKey::from(predicate.value);
+            switch (predicate.op) {
+            case CompareOp::Equal:
+                if (key < stats.min || stats.max < key) {
+                    return false;
+                }
+                break;
+            case CompareOp::Less:
+                if (!(stats.min < key)) {
+                    return false;
+                }
+                break;
+            case CompareOp::LessEqual:
+                if (key < stats.min) {
+                    return false;
+                }
+                break;
+            case CompareOp::Greater:
+                if (!(key < stats.max)) {
+                    return false;
+                }
+                break;
+            case CompareOp::GreaterEqual:
+                if (stats.max < key) {
+                    return false;
+                }
+                break;
+            }
+        }
+        return true;
+    }
 
-        for (int fileIndex = 1;; ++fileIndex) {
-            std::string fileName = tableDir + "/" + std::to_string(fileIndex) + ".csv";
-            if (!fs::exists(fileName)) {
+    // SELECT через B+дерево и/или с ORDER BY. Если у одного из столбцов условий есть дерево,
+    // из него берутся pk в границах условий по этому столбцу, строки читаются по индексу
+    // первичного ключа и проверяются всеми условиями. Иначе, если дерево есть у столбца
+    // сортировки, оно обходится целиком; иначе сегменты сканируются. Без сортировки строки
+    // выдаются в порядке pk, как при сканировании. Вызывается под разделяемой блокировкой.
+    void selectOrdered(const QueryPlan& plan, ResultSink& sink) {
+        const std::string& tableName = plan.tableName;
+        const std::map<int, BPlusTree<IndexKey, int>>& ranges = rangeIndexes.at(tableName);
+        const std::map<int, RowLocation>& pkIndex = pkIndexes.at(tableName);
+        std::vector<std::string> rows;
+        std::vector<IndexKey> orderKeys; // ключ ORDER BY каждой строки rows, если нужна сортировка
+
+        int driving = -1;
+        for (const Predicate& predicate : plan.predicates) {
+            if (ranges.count(predicate.column)) {
+                driving = predicate.column;
                 break;
             }
+        }
+        if (driving == -1 && ranges.count(plan.orderColumn)) {
+            driving = plan.orderColumn;
+        }
+        bool ordered = driving != -1 && plan.orderColumn == driving;
+        bool sort = plan.orderColumn != -1 && (!ordered || plan.descending);
+        auto addOrderKey = [&](size_t fieldCount, auto field) {
+            if (sort) {
+                orderKeys.push_back(IndexKey::from(static_cast<size_t>(plan.orderColumn) < fieldCount
+                    ? field(plan.orderColumn) : std::string_view()));
+            }
+        };
 
-            std::ifstream inFile(fileName);
-            std::string line;
-            bool isHeader = true;
+        if (driving == -1) {
+            for (const SegmentInfo& segment : manifests.at(tableName).segments) {
+                if (!segmentMayMatch(plan, segment)) {
+                    continue;
+                }
+                SegmentReader reader(getSegmentFile(tableName, segment.id), getFormat(tableName));
+                for (size_t row = 0; row < reader.rowCount(); ++row) {
+                    if ((segment.deadRows > 0 && isDeleted(tableName, reader.pk(row))) || !rowMatches(plan, reader, row)) {
+                        continue;
+                    }
+                    reader.appendRow(row, rows.emplace_back());
+                    addOrderKey(reader.fieldCount(row), [&](int column) { return reader.field(row, column); });
+                }
+            }
+        } else {
+            // Самые узкие границы из условий по столбцу driving
+            std::vector<IndexKey> keys;
+            keys.reserve(plan.predicates.size());
+            const IndexKey* low = nullptr;
+            const IndexKey* high = nullptr;
+            bool lowInclusive = true;
+            bool highInclusive = true;
+            for (const Predicate& predicate : plan.predicates) {
+                if (predicate.column != driving) {
+                    continue;
+                }
+                const IndexKey& key = keys.emplace_back(IndexKey::from(predicate.value));
+                bool inclusive = predicate.op != CompareOp::Less && predicate.op != CompareOp::Greater;
+                if (predicate.op != CompareOp::Less && predicate.op != CompareOp::LessEqual
+                    && (low == nullptr || *low < key || (!(key < *low) && !inclusive))) {
+                    low = &key;
+                    lowInclusive = inclusive;
+                }
+                if (predicate.op != CompareOp::Greater && predicate.op != CompareOp::GreaterEqual
+                    && (high == nullptr || key < *high || (!(*high < key) && !inclusive))) {
+                    high = &key;
+                    highInclusive = inclusive;
+                }
+            }
+
+            std::vector<int> pks;
+            ranges.at(driving).visitRange(low, lowInclusive, high, highInclusive,
+                [&](const IndexKey&, int pk) { pks.push_back(pk); });
+            if (!ordered) {
+                std::sort(pks.begin(), pks.end());
+            }
 
-            while (std::getline(inFile, line)) {
-                if (isHeader) {
-                    isHeader = false; // Пропускаем заголовок
+            std::map<int, std::unique_ptr<SegmentReader>> readers;
+            std::vector<std::string_view> fields;
+            for (int pk : pks) {
+                auto location = pkIndex.find(pk);
+                if (location == pkIndex.end()) {
                     continue;
                 }
-                rows.push_back(split(line, ','));
+                std::unique_ptr<SegmentReader>& reader = readers[location->second.segmentId];
+                if (!reader) {
+                    reader = std::make_unique<SegmentReader>(getSegmentFile(tableName, location->second.segmentId), getFormat(tableName), false);
+                }
+                reader->fieldsAt(location->second.offset, fields);
+                if (std::all_of(plan.predicates.begin(), plan.predicates.end(), [&](const Predicate& predicate) {
+                    return static_cast<size_t>(predicate.column) < fields.size()
+                        && predicate.matches(fields[predicate.column], predicate.value);
+                })) {
+                    reader->appendRowAt(location->second.offset, rows.emplace_back());
+                    addOrderKey(fields.size(), [&](int column) { return fields[column]; });
+                }
+            }
+        }
+
+        if (sort) {
+            std::vector<size_t> order(rows.size());
+            for (size_t i = 0; i < order.size(); ++i) {
+                order[i] = i;
+            }
+            bool descending = plan.descending;
+            std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+                return descending ? orderKeys[b] < orderKeys[a] : orderKeys[a] < orderKeys[b];
+            });
+            for (size_t i : order) {
+                sink.writeRow(rows[i]);
+            }
+        } else {
+            for (const std::string& row : rows) {
+                sink.writeRow(row);
+            }
+        }
+        sink.flush();
+    }
+
+    static constexpr size_t crossJoinBlockRows = 4096;
+
+    // Соединяет блок строк внешней таблицы со всеми строками table2, сегмент за сегментом.
+    // Каждая пара собирается в переиспользуемый буфер output и передаётся в sink.
+    void crossJoinBlock(const std::string& table2, const std::string& outerBlock,
+        const std::vector<std::pair<size_t, size_t>>& outerRows, std::string& output, ResultSink& sink) {
+        std::string_view outer = outerBlock;
+        for (const SegmentInfo& segment : manifests.at(table2).segments) {
+            SegmentReader reader(getSegmentFile(table2, segment.id), getFormat(table2));
+            for (const auto& [offset, length] : outerRows) {
+                std::string_view row1 = outer.substr(offset, length);
+                for (size_t row = 0; row < reader.rowCount(); ++row) {
+                    if (segment.deadRows > 0 && isDeleted(table2, reader.pk(row))) {
+                        continue;
+                    }
+                    output.assign(row1).append(",");
+                    reader.appendRow(row, output);
+                    sink.writeRow(output);
+                }
+            }
+        }
+    }
+
+    int liveRowCount(const std::string& tableName) {
+        int count = 0;
+        for (const SegmentInfo& segment : manifests.at(tableName).segments) {
+            count += segment.rows - segment.deadRows;
+        }
+        return count;
+    }
+
+    std::string join(const std::vector<std::string>& parts, const std::string& delimiter) {
+        std::ostringstream oss;
+        for (size_t i = 0; i < parts.size(); ++i) {
+            oss << parts[i];
+            if (i != parts.size() - 1) {
+                oss << delimiter;
             }
         }
+        return oss.str();
+    }
 
-        return rows;
+    int parsePk(std::string_view field) {
+        int pk = 0;
+        std::from_chars(field.data(), field.data() + field.size(), pk);
+        return pk;
     }
 
+    // Индекс поля в строке сегмента: 0 — первичный ключ, далее столбцы схемы
     int getColumnIndex(const std::string& tableName, const std::string& columnName) {
         auto it = schema.structure.find(tableName);
         if (it == schema.structure.end()) {
             return -1;
         }
+        if (columnName == tableName + "_pk") {
+            return 0;
+        }
 
         const auto& columns = it->second;
         auto colIt = std::find(columns.begin(), columns.end(), columnName);
@@ -271,7 +3220,7 @@ private:
             return -1;
         }
 
-        return std::distance(columns.begin(), colIt);
+        return std::distance(columns.begin(), colIt) + 1;
     }
 };
 
@@ -288,6 +3237,17 @@ Schema loadSchema(const std::string& filePath) {
 
     schema.name = schemaJson["name"];
     schema.tuples_limit = schemaJson["tuples_limit"];
+    if (schemaJson.contains("compaction_threshold")) {
+        schema.compaction_threshold = schemaJson["compaction_threshold"];
+    }
+    if (schemaJson.contains("format")) {
+        schema.format = parseSegmentFormat(schemaJson["format"]);
+    }
+    if (schemaJson.contains("bloom_filters")) {
+        for (const auto& [tableName, columns] : schemaJson["bloom_filters"].items()) {
+            schema.bloomFilters[tableName] = columns.get<std::vector<std::string>>();
+        }
+    }
     for (const auto& [tableName, columns] : schemaJson["structure"].items()) {
         schema.structure[tableName] = columns.get<std::vector<std::string>>();
     }
@@ -295,35 +3255,346 @@ Schema loadSchema(const std::string& filePath) {
     return schema;
 }
 
-// Функция для обработки SQL-запросов
-void processQuery(Database& db, const std::string& query) {
+std::string trim(const std::string& str) {
+    size_t first = str.find_first_not_of(" \t");
+    size_t last = str.find_last_not_of(" \t");
+    return first == std::string::npos ? "" : str.substr(first, last - first + 1);
+}
+
+int parsePrimaryKey(const std::string& text) {
+    int pk = 0;
+    const char* end = text.data() + text.size();
+    auto result = std::from_chars(text.data(), end, pk);
+    if (text.empty() || result.ec != std::errc() || result.ptr != end) {
+        throw std::runtime_error("Invalid primary key: '" + text + "'");
+    }
+    return pk;
+}
+
+// Подготовленный запрос: текст разбирается, а столбцы условий разрешаются один раз
+// в prepareQuery; при каждом выполнении подставляются только значения параметров '?'
+class PreparedStatement {
+public:
+    enum class Kind {
+        Insert,
+        Select,
+        SelectByPk,
+        Join,
+        Delete,
+        CreateIndex
+    };
+
+    PreparedStatement(Database& db, Kind kind, const std::string& tableName)
+        : db(&db), kind(kind), tableName(tableName) {
+    }
+
+    size_t parameterCount() const {
+        return parameters.size();
+    }
+
+    // Параметры нумеруются с 1 в порядке появления '?' в тексте запроса
+    void bind(size_t index, const std::string& value) {
+        if (index == 0 || index > parameters.size()) {
+            throw std::out_of_range("Parameter index out of range: " + std::to_string(index));
+        }
+        const Parameter& parameter = parameters[index - 1];
+        switch (parameter.target) {
+        case Parameter::Target::InsertValue:
+            rows[parameter.row][parameter.column] = value;
+            break;
+        case Parameter::Target::Condition:
+            plan.predicates[parameter.column].value = value;
+            break;
+        case Parameter::Target::PrimaryKey:
+            pk = parsePrimaryKey(value);
+            break;
+        }
+        bound[index - 1] = true;
+    }
+
+    void bind(size_t index, int value) {
+        bind(index, std::to_string(value));
+    }
+
+    // Режим сканирования для SELECT без ORDER BY и условий по B+деревьям
+    void setScanMode(ScanMode mode) {
+        scanMode = mode;
+    }
+
+    void execute() {
+        StreamSink sink(std::cout);
+        execute(sink);
+    }
+
+    void execute(ResultSink& sink) {
+        for (size_t i = 0; i < bound.size(); ++i) {
+            if (!bound[i]) {
+                throw std::runtime_error("Parameter " + std::to_string(i + 1) + " is not bound");
+            }
+        }
+
+        switch (kind) {
+        case Kind::Insert:
+            db->insertMany(tableName, rows);
+            break;
+        case Kind::Select:
+            db->select(plan, scanMode, sink);
+            break;
+        case Kind::SelectByPk:
+            db->selectByPk(tableName, pk, sink);
+            break;
+        case Kind::Join:
+            db->hashJoin(tableName, joinTable, joinColumn1, joinColumn2, sink);
+            break;
+        case Kind::Delete:
+            db->deleteFrom(tableName, pk);
+            break;
+        case Kind::CreateIndex:
+            db->createIndex(tableName, indexColumn);
+            break;
+        }
+    }
+
+private:
+    friend PreparedStatement prepareQuery(Database& db, const std::string& query);
+
+    // Куда подставляется параметр: значение вставляемой строки, условие SELECT или первичный ключ
+    struct Parameter {
+        enum class Target {
+            InsertValue,
+            Condition,
+            PrimaryKey
+        };
+        Target target;
+        size_t row;
+        size_t column;
+    };
+
+    Database* db;
+    Kind kind;
+    std::string tableName;
+    std::vector<std::vector<std::string>> rows; // Insert
+    QueryPlan plan;                              // Select
+    ScanMode scanMode = ScanMode::Sequential;
+    int pk = 0;                                  // SelectByPk, Delete
+    std::string joinTable;                       // Join
+    std::string joinColumn1;
+    std::string joinColumn2;
+    std::string indexColumn;                     // CreateIndex
+    std::vector<Parameter> parameters;
+    std::vector<bool> bound;
+
+    void addParameter(Parameter::Target target, size_t row, size_t column) {
+        parameters.push_back({ target, row, column });
+        bound.push_back(false);
+    }
+};
+
+// Разбирает запрос:
+//   INSERT [INTO] <table> [VALUES] (...), (...), ...
+//   SELECT <table> [<pk>]
+//   SELECT <table> [WHERE <condition> [AND <condition> ...]] [ORDER BY <col> [ASC | DESC]]
+//   SELECT <table1>, <table2> [WHERE <table1>.<col> = <table2>.<col>]
+//   DELETE [FROM] <table> <pk>
+//   CREATE INDEX ON <table>(<col>) [USING BTREE]
+// condition: <col> = | < | <= | > | >= <value> или <col> BETWEEN <value> AND <value>.
+// Вместо значения, первичного ключа или значения условия можно указать параметр '?'.
+PreparedStatement prepareQuery(Database& db, const std::string& query) {
+    using Target = PreparedStatement::Parameter::Target;
     std::istringstream iss(query);
     std::string command;
     iss >> command;
 
     if (command == "INSERT") {
         std::string tableName;
-        std::string valuesSegment;
         iss >> tableName;
-        iss.ignore(6); // Пропустить "INTO"
-        std::getline(iss, valuesSegment, ')');
-        valuesSegment.erase(0, valuesSegment.find('(') + 1);
-        std::vector<std::string> values;
-        std::istringstream vs(valuesSegment);
-        std::string value;
-        while (std::getline(vs, value, ',')) {
-            values.push_back(value);
-        }
-        db.insertInto(tableName, values);
-    } else if (command == "SELECT") {
+        if (tableName == "INTO") {
+            iss >> tableName;
+        }
+        std::string valuesSegment;
+        std::getline(iss, valuesSegment);
+        size_t paren = tableName.find('(');
+        if (paren != std::string::npos) {
+            valuesSegment = tableName.substr(paren) + valuesSegment;
+            tableName.erase(paren);
+        }
+
+        PreparedStatement statement(db, PreparedStatement::Kind::Insert, tableName);
+        for (size_t open = valuesSegment.find('('); open != std::string::npos; open = valuesSegment.find('(', open)) {
+            size_t close = valuesSegment.find(')', open);
+            if (close == std::string::npos) {
+                throw std::runtime_error("Invalid INSERT query: missing ')'");
+            }
+            std::vector<std::string>& values = statement.rows.emplace_back();
+            std::istringstream vs(valuesSegment.substr(open + 1, close - open - 1));
+            std::string value;
+            while (std::getline(vs, value, ',')) {
+                values.push_back(trim(value));
+                if (values.back() == "?") {
+                    statement.addParameter(Target::InsertValue, statement.rows.size() - 1, values.size() - 1);
+                }
+            }
+            open = close;
+        }
+        return statement;
+    }
+
+    if (command == "SELECT") {
+        std::string rest;
+        std::getline(iss, rest);
+        std::string orderBy;
+        bool descending = false;
+        size_t orderPos = rest.find(" ORDER BY ");
+        if (orderPos != std::string::npos) {
+            std::istringstream os(rest.substr(orderPos + 10));
+            std::string direction;
+            os >> orderBy >> direction;
+            descending = direction == "DESC";
+            rest.erase(orderPos);
+        }
+        size_t wherePos = rest.find("WHERE");
+        std::string tables = rest.substr(0, wherePos);
+        std::string condition = wherePos == std::string::npos ? "" : rest.substr(wherePos + 5);
+        size_t comma = tables.find(',');
+
+        if (comma != std::string::npos) {
+            if (!orderBy.empty()) {
+                throw std::runtime_error("ORDER BY is not supported for joins");
+            }
+            PreparedStatement statement(db, PreparedStatement::Kind::Join, trim(tables.substr(0, comma)));
+            const std::string& table1 = statement.tableName;
+            std::string table2 = trim(tables.substr(comma + 1));
+            statement.joinTable = table2;
+            if (wherePos != std::string::npos) {
+                size_t eq = condition.find('=');
+                if (eq == std::string::npos) {
+                    throw std::runtime_error("Invalid join condition: " + condition);
+                }
+                std::string left = trim(condition.substr(0, eq));
+                std::string right = trim(condition.substr(eq + 1));
+                if (left.rfind(table2 + ".", 0) == 0 && right.rfind(table1 + ".", 0) == 0) {
+                    std::swap(left, right);
+                }
+                if (left.rfind(table1 + ".", 0) != 0 || right.rfind(table2 + ".", 0) != 0) {
+                    throw std::runtime_error("Invalid join condition: " + condition);
+                }
+                statement.joinColumn1 = left.substr(table1.size() + 1);
+                statement.joinColumn2 = right.substr(table2.size() + 1);
+            }
+            return statement;
+        }
+
+        std::istringstream ts(tables);
         std::string tableName;
+        std::string pk;
+        ts >> tableName >> pk;
+        if (!pk.empty()) {
+            PreparedStatement statement(db, PreparedStatement::Kind::SelectByPk, tableName);
+            if (pk == "?") {
+                statement.addParameter(Target::PrimaryKey, 0, 0);
+            } else {
+                statement.pk = parsePrimaryKey(pk);
+            }
+            return statement;
+        }
+
+        std::vector<std::string> terms;
+        for (size_t start = 0; wherePos != std::string::npos && start < condition.size();) {
+            size_t andPos = condition.find(" AND ", start);
+            terms.push_back(condition.substr(start, andPos == std::string::npos ? std::string::npos : andPos - start));
+            start = andPos == std::string::npos ? condition.size() : andPos + 5;
+        }
+
+        // Условия в порядке текста запроса; BETWEEN a AND b становится парой условий >= a и <= b
+        std::vector<Condition> conditions;
+        for (size_t i = 0; i < terms.size(); ++i) {
+            const std::string& term = terms[i];
+            size_t between = term.find(" BETWEEN ");
+            if (between != std::string::npos) {
+                if (i + 1 == terms.size()) {
+                    throw std::runtime_error("Invalid condition: " + term);
+                }
+                std::string column = trim(term.substr(0, between));
+                conditions.push_back({ column, CompareOp::GreaterEqual, trim(term.substr(between + 9)) });
+                conditions.push_back({ column, CompareOp::LessEqual, trim(terms[++i]) });
+                continue;
+            }
+            size_t opPos = term.find_first_of("<>=");
+            if (opPos == std::string::npos) {
+                throw std::runtime_error("Invalid condition: " + term);
+            }
+            CompareOp op = CompareOp::Equal;
+            size_t opLength = 1;
+            if (term[opPos] != '=') {
+                bool orEqual = opPos + 1 < term.size() && term[opPos + 1] == '=';
+                if (term[opPos] == '<') {
+                    op = orEqual ? CompareOp::LessEqual : CompareOp::Less;
+                } else {
+                    op = orEqual ? CompareOp::GreaterEqual : CompareOp::Greater;
+                }
+                opLength += orEqual ? 1 : 0;
+            }
+            conditions.push_back({ trim(term.substr(0, opPos)), op, trim(term.substr(opPos + opLength)) });
+        }
+
+        PreparedStatement statement(db, PreparedStatement::Kind::Select, tableName);
+        statement.plan = db.compileSelect(tableName, conditions, orderBy, descending);
+        for (size_t i = 0; i < conditions.size(); ++i) {
+            if (conditions[i].value == "?") {
+                statement.addParameter(Target::Condition, 0, i);
+            }
+        }
+        return statement;
+    }
+
+    if (command == "DELETE") {
+        std::string tableName;
+        std::string pk;
         iss >> tableName;
-        db.select(tableName, {});
-    } else if (command == "DELETE") {
+        if (tableName == "FROM") {
+            iss >> tableName;
+        }
+        iss >> pk;
+        PreparedStatement statement(db, PreparedStatement::Kind::Delete, tableName);
+        if (pk == "?") {
+            statement.addParameter(Target::PrimaryKey, 0, 0);
+        } else {
+            statement.pk = parsePrimaryKey(pk);
+        }
+        return statement;
+    }
+
+    if (command == "CREATE") {
+        std::string rest;
+        std::getline(iss, rest);
+        size_t open = rest.find('(');
+        size_t close = rest.find(')', open);
+        std::istringstream head(rest.substr(0, open));
+        std::string index;
+        std::string on;
         std::string tableName;
-        int pk;
-        iss >> tableName >> pk;
-        db.deleteFrom(tableName, pk);
+        head >> index >> on >> tableName;
+        if (index != "INDEX" || on != "ON" || open == std::string::npos || close == std::string::npos) {
+            throw std::runtime_error("Invalid CREATE INDEX query: " + query);
+        }
+        PreparedStatement statement(db, PreparedStatement::Kind::CreateIndex, tableName);
+        statement.indexColumn = trim(rest.substr(open + 1, close - open - 1));
+        return statement;
+    }
+
+    throw std::runtime_error("Unknown command: " + command);
+}
+
+// Функция для обработки SQL-запросов. Ошибка разбора или выполнения сообщается
+// для каждого запроса отдельно и не прерывает работу
+void processQuery(Database& db, const std::string& query) {
+    if (trim(query).empty()) {
+        return;
+    }
+    try {
+        prepareQuery(db, query).execute();
+    } catch (const std::exception& ex) {
+        std::cerr << "Ошибка: " << ex.what() << std::endl;
     }
 }
 
@@ -337,8 +3608,7 @@ int main() {
         std::string query;
         while (true) {
             std::cout << "Введите запрос: ";
-            std::getline(std::cin, query);
-            if (query == "EXIT") {
+            if (!std::getline(std::cin, query) || query == "EXIT") {
                 break;
             }
             processQuery(db, query);
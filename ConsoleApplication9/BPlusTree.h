@@ -0,0 +1,232 @@
+﻿#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <iterator>
+#include <functional>
+#include <charconv>
+#include <system_error>
+
+// Ключ упорядоченного индекса: значения, которые целиком разбираются как число, сравниваются
+// как числа и идут раньше остальных; остальные сравниваются лексикографически
+struct IndexKey {
+    bool numeric = false;
+    double number = 0;
+    std::string text;
+
+    static IndexKey from(std::string_view value) {
+        IndexKey key;
+        double number = 0;
+        const char* end = value.data() + value.size();
+        auto result = std::from_chars(value.data(), end, number);
+        if (!value.empty() && result.ec == std::errc() && result.ptr == end && number == number) {
+            key.numeric = true;
+            key.number = number;
+        } else {
+            key.text = value;
+        }
+        return key;
+    }
+
+    // Текстовая запись ключа: IndexKey::from(key.toString()) даёт тот же ключ
+    std::string toString() const {
+        if (!numeric) {
+            return text;
+        }
+        char buffer[32];
+        auto result = std::to_chars(buffer, buffer + sizeof(buffer), number);
+        return std::string(buffer, result.ptr);
+    }
+
+    friend bool operator<(const IndexKey& a, const IndexKey& b) {
+        if (a.numeric != b.numeric) {
+            return a.numeric;
+        }
+        return a.numeric ? a.number < b.number : a.text < b.text;
+    }
+};
+
+// B+дерево в памяти с повторяющимися ключами. Значения хранятся только в листьях, листья
+// связаны в список для последовательного обхода диапазона; равные ключи идут в порядке вставки.
+// Удаление не поддерживается: при изменении данных индекс строится заново (clear + insert).
+template <typename Key, typename Value, typename Compare = std::less<Key>>
+class BPlusTree {
+    struct Node;
+
+public:
+    class Iterator {
+    public:
+        const Key& key() const {
+            return node->keys[pos];
+        }
+
+        const Value& value() const {
+            return node->values[pos];
+        }
+
+        Iterator& operator++() {
+            if (++pos == node->keys.size()) {
+                node = node->next;
+                pos = 0;
+            }
+            return *this;
+        }
+
+        bool operator==(const Iterator& other) const {
+            return node == other.node && pos == other.pos;
+        }
+
+        bool operator!=(const Iterator& other) const {
+            return !(*this == other);
+        }
+
+    private:
+        friend class BPlusTree;
+
+        const Node* node = nullptr;
+        size_t pos = 0;
+
+        Iterator() = default;
+
+        // Позиция за концом листа переносится в начало следующего
+        Iterator(const Node* node, size_t pos) : node(node), pos(pos) {
+            if (this->node != nullptr && this->pos == this->node->keys.size()) {
+                this->node = this->node->next;
+                this->pos = 0;
+            }
+        }
+    };
+
+    BPlusTree() {
+        clear();
+    }
+
+    void insert(const Key& key, const Value& value) {
+        Key separator;
+        std::unique_ptr<Node> sibling;
+        if (insertInto(*root, key, value, separator, sibling)) {
+            auto newRoot = std::make_unique<Node>();
+            newRoot->leaf = false;
+            newRoot->keys.push_back(std::move(separator));
+            newRoot->children.push_back(std::move(root));
+            newRoot->children.push_back(std::move(sibling));
+            root = std::move(newRoot);
+        }
+        ++count;
+    }
+
+    void clear() {
+        root = std::make_unique<Node>();
+        count = 0;
+    }
+
+    size_t size() const {
+        return count;
+    }
+
+    Iterator begin() const {
+        const Node* node = root.get();
+        while (!node->leaf) {
+            node = node->children.front().get();
+        }
+        return node->keys.empty() ? end() : Iterator(node, 0);
+    }
+
+    Iterator end() const {
+        return Iterator();
+    }
+
+    // Первый элемент с ключом не меньше key
+    Iterator lowerBound(const Key& key) const {
+        const Node* node = root.get();
+        while (!node->leaf) {
+            node = node->children[std::lower_bound(node->keys.begin(), node->keys.end(), key, compare) - node->keys.begin()].get();
+        }
+        return Iterator(node, std::lower_bound(node->keys.begin(), node->keys.end(), key, compare) - node->keys.begin());
+    }
+
+    // Первый элемент с ключом больше key
+    Iterator upperBound(const Key& key) const {
+        const Node* node = root.get();
+        while (!node->leaf) {
+            node = node->children[std::upper_bound(node->keys.begin(), node->keys.end(), key, compare) - node->keys.begin()].get();
+        }
+        return Iterator(node, std::upper_bound(node->keys.begin(), node->keys.end(), key, compare) - node->keys.begin());
+    }
+
+    // Обходит элементы диапазона по возрастанию ключа; nullptr — граница не задана
+    template <typename Visit>
+    void visitRange(const Key* low, bool lowInclusive, const Key* high, bool highInclusive, Visit visit) const {
+        Iterator it = low == nullptr ? begin() : lowInclusive ? lowerBound(*low) : upperBound(*low);
+        for (; it != end(); ++it) {
+            if (high != nullptr && (highInclusive ? compare(*high, it.key()) : !compare(it.key(), *high))) {
+                break;
+            }
+            visit(it.key(), it.value());
+        }
+    }
+
+private:
+    static constexpr size_t order = 64; // наибольшее число ключей в узле
+
+    // Внутренний узел: keys.size() + 1 потомков, в потомке i ключи из [keys[i - 1], keys[i]].
+    // Лист: ключи и значения по возрастанию, next — следующий лист.
+    struct Node {
+        bool leaf = true;
+        std::vector<Key> keys;
+        std::vector<std::unique_ptr<Node>> children;
+        std::vector<Value> values;
+        Node* next = nullptr;
+    };
+
+    std::unique_ptr<Node> root;
+    size_t count = 0;
+    Compare compare;
+
+    // Вставляет в поддерево; при переполнении узла делит его и возвращает true,
+    // отдавая разделяющий ключ и новый правый узел
+    bool insertInto(Node& node, const Key& key, const Value& value, Key& separator, std::unique_ptr<Node>& sibling) {
+        // upper_bound: новый ключ встаёт после равных, что сохраняет порядок вставки
+        size_t pos = std::upper_bound(node.keys.begin(), node.keys.end(), key, compare) - node.keys.begin();
+        if (node.leaf) {
+            node.keys.insert(node.keys.begin() + pos, key);
+            node.values.insert(node.values.begin() + pos, value);
+            if (node.keys.size() <= order) {
+                return false;
+            }
+            size_t mid = node.keys.size() / 2;
+            sibling = std::make_unique<Node>();
+            sibling->keys.assign(std::make_move_iterator(node.keys.begin() + mid), std::make_move_iterator(node.keys.end()));
+            sibling->values.assign(std::make_move_iterator(node.values.begin() + mid), std::make_move_iterator(node.values.end()));
+            node.keys.erase(node.keys.begin() + mid, node.keys.end());
+            node.values.erase(node.values.begin() + mid, node.values.end());
+            sibling->next = node.next;
+            node.next = sibling.get();
+            separator = sibling->keys.front();
+            return true;
+        }
+
+        Key childSeparator;
+        std::unique_ptr<Node> childSibling;
+        if (!insertInto(*node.children[pos], key, value, childSeparator, childSibling)) {
+            return false;
+        }
+        node.keys.insert(node.keys.begin() + pos, std::move(childSeparator));
+        node.children.insert(node.children.begin() + pos + 1, std::move(childSibling));
+        if (node.keys.size() <= order) {
+            return false;
+        }
+        size_t mid = node.keys.size() / 2;
+        sibling = std::make_unique<Node>();
+        sibling->leaf = false;
+        separator = std::move(node.keys[mid]);
+        sibling->keys.assign(std::make_move_iterator(node.keys.begin() + mid + 1), std::make_move_iterator(node.keys.end()));
+        sibling->children.assign(std::make_move_iterator(node.children.begin() + mid + 1), std::make_move_iterator(node.children.end()));
+        node.keys.erase(node.keys.begin() + mid, node.keys.end());
+        node.children.erase(node.children.begin() + mid + 1, node.children.end());
+        return true;
+    }
+};
@@ -1,21 +1,166 @@
 ﻿#include <iostream>
 #include <sstream>
 #include <string>
+#include <string_view>
 #include <filesystem>
+#include <vector>
+#include <unordered_map>
+#include <cctype>
+#include <algorithm>
+#include <memory>
+#include <cstring>
+#include <cstddef>
+#include <chrono>
 #include <regex>
+#include "ResultSink.h"
+#include "BPlusTree.h"
 
 using namespace std;
 
+// Арена: память выделяется сдвигом указателя внутри крупных блоков
+// и освобождается только целиком (reset или деструктор)
+class Arena {
+public:
+    explicit Arena(size_t blockSize = 1 << 16) : blockSize(blockSize), used(0), blockCapacity(0) {
+    }
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+    Arena(Arena&&) = default;
+    Arena& operator=(Arena&&) = default;
+
+    void* allocate(size_t size, size_t alignment = alignof(max_align_t)) {
+        size_t offset = (used + alignment - 1) & ~(alignment - 1);
+        if (blocks.empty() || offset + size > blockCapacity) {
+            blockCapacity = max(blockSize, size);
+            blocks.push_back(make_unique<char[]>(blockCapacity));
+            offset = 0;
+        }
+        used = offset + size;
+        allocatedBytes += size;
+        return blocks.back().get() + offset;
+    }
+
+    template <typename T>
+    T* allocateArray(size_t count) {
+        return static_cast<T*>(allocate(sizeof(T) * count, alignof(T)));
+    }
+
+    // Копия строки в арене
+    string_view copy(string_view value) {
+        if (value.empty()) {
+            return string_view();
+        }
+        char* data = allocateArray<char>(value.size());
+        memcpy(data, value.data(), value.size());
+        return string_view(data, value.size());
+    }
+
+    void reset() {
+        blocks.clear();
+        used = 0;
+        blockCapacity = 0;
+        allocatedBytes = 0;
+    }
+
+    // Сколько байт выдано с последнего reset, включая уже ненужные
+    size_t allocated() const {
+        return allocatedBytes;
+    }
+
+private:
+    size_t blockSize;
+    size_t used;
+    size_t blockCapacity;
+    size_t allocatedBytes = 0;
+    vector<unique_ptr<char[]>> blocks;
+};
+
+// Строка таблицы: Row и массив ячеек лежат в арене таблицы, значения ячеек — тоже
 struct Row {
-    string* data;
+    string_view* data;
     int size;
+};
+
+// Столбец колоночной таблицы: значения лежат подряд в одной строке-арене,
+// значение i — arena[offsets[i], offsets[i + 1])
+struct Column {
+    string arena;
+    vector<size_t> offsets{ 0 };
 
-    Row(int size) : size(size) {
-        data = new string[size];
+    string_view get(int i) const {
+        return string_view(arena).substr(offsets[i], offsets[i + 1] - offsets[i]);
     }
 
-    ~Row() {
-        delete[] data;
+    void push(const string& value) {
+        arena.append(value);
+        offsets.push_back(arena.size());
+    }
+
+    // Оставляет только значения с keep[i] == true
+    void retain(const vector<bool>& keep) {
+        size_t write = 0;
+        size_t kept = 0;
+        for (size_t i = 0; i < keep.size(); ++i) {
+            if (!keep[i]) {
+                continue;
+            }
+            size_t length = offsets[i + 1] - offsets[i];
+            copy(arena.begin() + offsets[i], arena.begin() + offsets[i + 1], arena.begin() + write);
+            write += length;
+            offsets[++kept] = write;
+        }
+        arena.resize(write);
+        offsets.resize(kept + 1);
+    }
+};
+
+// Rows — массив строк Row, Columns — по одному плотному столбцу Column на столбец таблицы
+enum class Layout {
+    Rows,
+    Columns
+};
+
+enum class IndexType {
+    Hash,
+    BTree
+};
+
+enum class CompareOp {
+    Equal,
+    Less,
+    LessEqual,
+    Greater,
+    GreaterEqual,
+    Between
+};
+
+// Условие WHERE над одним столбцом; column = -1 — условия нет. Равенство сравнивает строки
+// как есть, диапазоны — по IndexKey (числа как числа). BETWEEN: value <= x <= upper.
+struct Condition {
+    int column = -1;
+    CompareOp op = CompareOp::Equal;
+    string value;
+    string upper;
+
+    // low и high — value и upper, заранее приведённые к IndexKey
+    bool matches(string_view cell, const IndexKey& low, const IndexKey& high) const {
+        if (op == CompareOp::Equal) {
+            return cell == value;
+        }
+        IndexKey key = IndexKey::from(cell);
+        switch (op) {
+        case CompareOp::Less:
+            return key < low;
+        case CompareOp::LessEqual:
+            return !(low < key);
+        case CompareOp::Greater:
+            return low < key;
+        case CompareOp::GreaterEqual:
+            return !(key < low);
+        default:
+            return !(key < low) && !(high < key);
+        }
     }
 };
 
@@ -23,24 +168,34 @@ struct Table {
     string name;
     string* columns;
     int columnCount;
+    unordered_map<string, int> columnOrdinals; // имя столбца -> номер
+    Layout layout;
     Row** rows;
     int rowCount;
     int capacity;
+    vector<Column> columnData; // Layout::Columns
+    Arena arena;               // Layout::Rows: строки и значения ячеек
+    vector<Row*> freeRows;     // освобождённые Row с массивами ячеек для повторного использования
+    // Хеш-индексы CREATE INDEX: номер столбца -> значение -> номера строк по возрастанию
+    unordered_map<int, unordered_map<string, vector<int>>> hashIndexes;
+    // Упорядоченные индексы CREATE INDEX ... USING BTREE: номер столбца -> дерево ключ -> номер строки
+    unordered_map<int, BPlusTree<IndexKey, int>> orderedIndexes;
 
-    Table(const string& name, const string* columns, int columnCount)
-        : name(name), columnCount(columnCount), rowCount(0), capacity(10) {
+    Table(const string& name, const string* columns, int columnCount, Layout layout = Layout::Rows)
+        : name(name), columnCount(columnCount), layout(layout), rowCount(0), capacity(10) {
         this->columns = new string[columnCount];
         for (int i = 0; i < columnCount; ++i) {
             this->columns[i] = columns[i];
+            columnOrdinals.emplace(columns[i], i);
         }
         rows = new Row * [capacity];
+        if (layout == Layout::Columns) {
+            columnData.resize(columnCount);
+        }
     }
 
     ~Table() {
         delete[] columns;
-        for (int i = 0; i < rowCount; ++i) {
-            delete rows[i];
-        }
         delete[] rows;
     }
 
@@ -49,6 +204,19 @@ struct Table {
             cerr << "Error: Number of values does not match number of columns.\n";
             return;
         }
+        for (auto& [column, index] : hashIndexes) {
+            index[values[column]].push_back(rowCount);
+        }
+        for (auto& [column, index] : orderedIndexes) {
+            index.insert(IndexKey::from(values[column]), rowCount);
+        }
+        if (layout == Layout::Columns) {
+            for (int i = 0; i < size; ++i) {
+                columnData[i].push(values[i]);
+            }
+            ++rowCount;
+            return;
+        }
         if (rowCount == capacity) {
             capacity *= 2;
             Row** newRows = new Row * [capacity];
@@ -58,26 +226,63 @@ struct Table {
             delete[] rows;
             rows = newRows;
         }
-        rows[rowCount++] = new Row(size);
+        Row* row;
+        if (!freeRows.empty()) {
+            row = freeRows.back();
+            freeRows.pop_back();
+        }
+        else {
+            row = arena.allocateArray<Row>(1);
+            row->data = arena.allocateArray<string_view>(size);
+            row->size = size;
+        }
         for (int i = 0; i < size; ++i) {
-            rows[rowCount - 1]->data[i] = values[i];
+            row->data[i] = arena.copy(values[i]);
         }
+        rows[rowCount++] = row;
     }
 
     void select(const string* selectColumns, int selectCount, const string& conditionCol, const string& conditionVal) {
+        StreamSink sink(cout);
+        select(selectColumns, selectCount, conditionCol, conditionVal, sink);
+    }
+
+    string_view cell(int row, int column) const {
+        return layout == Layout::Columns ? columnData[column].get(row) : rows[row]->data[column];
+    }
+
+    void createIndex(const string& column, IndexType type = IndexType::Hash) {
+        int index = columnIndex(column);
+        if (index == -1) {
+            cerr << "Error: Column " << column << " not found.\n";
+            return;
+        }
+        if (type == IndexType::Hash ? hashIndexes.count(index) != 0 : orderedIndexes.count(index) != 0) {
+            cerr << "Error: Index on " << name << "(" << column << ") already exists.\n";
+            return;
+        }
+        if (type == IndexType::Hash) {
+            buildIndex(index);
+        }
+        else {
+            buildOrderedIndex(index);
+        }
+        cout << "Index on " << name << "(" << column << ") created.\n";
+    }
+
+    // Номер столбца по имени или -1
+    int columnIndex(const string& column) const {
+        auto it = columnOrdinals.find(column);
+        return it == columnOrdinals.end() ? -1 : it->second;
+    }
+
+    void select(const string* selectColumns, int selectCount, const string& conditionCol, const string& conditionVal, ResultSink& sink) {
         int* selectIndices = new int[selectCount];
         int conditionIndex = -1;
 
         for (int i = 0; i < selectCount; ++i) {
-            bool found = false;
-            for (int j = 0; j < columnCount; ++j) {
-                if (columns[j] == selectColumns[i]) {
-                    selectIndices[i] = j;
-                    found = true;
-                    break;
-                }
-            }
-            if (!found) {
+            selectIndices[i] = columnIndex(selectColumns[i]);
+            if (selectIndices[i] == -1) {
                 cerr << "Error: Column " << selectColumns[i] << " not found.\n";
                 delete[] selectIndices;
                 return;
@@ -85,12 +290,7 @@ struct Table {
         }
 
         if (!conditionCol.empty()) {
-            for (int i = 0; i < columnCount; ++i) {
-                if (columns[i] == conditionCol) {
-                    conditionIndex = i;
-                    break;
-                }
-            }
+            conditionIndex = columnIndex(conditionCol);
             if (conditionIndex == -1) {
                 cerr << "Error: Condition column " << conditionCol << " not found.\n";
                 delete[] selectIndices;
@@ -98,54 +298,265 @@ struct Table {
             }
         }
 
+        Condition condition;
+        condition.column = conditionIndex;
+        condition.value = conditionVal;
+        select(selectIndices, selectCount, condition, -1, false, sink);
+        delete[] selectIndices;
+    }
+
+    // Выборка по заранее найденным номерам столбцов; orderColumn = -1 — без ORDER BY
+    void select(const int* selectIndices, int selectCount, const Condition& condition, int orderColumn, bool descending, ResultSink& sink) {
+        int conditionIndex = condition.column;
+        const string& conditionVal = condition.value;
+        string line;
+        if (condition.op != CompareOp::Equal || orderColumn != -1
+            || (!hashIndexes.count(conditionIndex) && orderedIndexes.count(conditionIndex))) {
+            bool ordered;
+            vector<int> found = findRows(condition, orderColumn, ordered);
+            if (orderColumn != -1 && (!ordered || descending)) {
+                vector<pair<IndexKey, int>> keyed;
+                keyed.reserve(found.size());
+                for (int row : found) {
+                    keyed.emplace_back(IndexKey::from(cell(row, orderColumn)), row);
+                }
+                stable_sort(keyed.begin(), keyed.end(), [descending](const auto& a, const auto& b) {
+                    return descending ? b.first < a.first : a.first < b.first;
+                });
+                for (size_t i = 0; i < keyed.size(); ++i) {
+                    found[i] = keyed[i].second;
+                }
+            }
+            for (int i : found) {
+                line.clear();
+                for (int j = 0; j < selectCount; ++j) {
+                    line.append(cell(i, selectIndices[j])).append(" ");
+                }
+                sink.writeRow(line);
+            }
+            sink.flush();
+            return;
+        }
+
+        auto index = conditionIndex == -1 ? hashIndexes.end() : hashIndexes.find(conditionIndex);
+        if (index != hashIndexes.end()) {
+            auto match = index->second.find(conditionVal);
+            if (match != index->second.end()) {
+                for (int i : match->second) {
+                    line.clear();
+                    for (int j = 0; j < selectCount; ++j) {
+                        line.append(cell(i, selectIndices[j])).append(" ");
+                    }
+                    sink.writeRow(line);
+                }
+            }
+            sink.flush();
+            return;
+        }
+        if (layout == Layout::Columns) {
+            // Фильтр читает только плотный столбец условия
+            const Column* condition = conditionIndex == -1 ? nullptr : &columnData[conditionIndex];
+            for (int i = 0; i < rowCount; ++i) {
+                if (condition && condition->get(i) != conditionVal) {
+                    continue;
+                }
+                line.clear();
+                for (int j = 0; j < selectCount; ++j) {
+                    line.append(columnData[selectIndices[j]].get(i)).append(" ");
+                }
+                sink.writeRow(line);
+            }
+            sink.flush();
+            return;
+        }
         for (int i = 0; i < rowCount; ++i) {
             if (conditionIndex != -1 && rows[i]->data[conditionIndex] != conditionVal) {
                 continue;
             }
+            line.clear();
             for (int j = 0; j < selectCount; ++j) {
-                cout << rows[i]->data[selectIndices[j]] << " ";
+                line.append(rows[i]->data[selectIndices[j]]).append(" ");
             }
-            cout << endl;
+            sink.writeRow(line);
         }
-
-        delete[] selectIndices;
+        sink.flush();
     }
 
     void deleteRows(const string& conditionCol, const string& conditionVal) {
         int conditionIndex = -1;
 
         if (!conditionCol.empty()) {
-            for (int i = 0; i < columnCount; ++i) {
-                if (columns[i] == conditionCol) {
-                    conditionIndex = i;
-                    break;
-                }
-            }
+            conditionIndex = columnIndex(conditionCol);
             if (conditionIndex == -1) {
                 cerr << "Error: Condition column " << conditionCol << " not found.\n";
                 return;
             }
         }
 
+        Condition condition;
+        condition.column = conditionIndex;
+        condition.value = conditionVal;
+        deleteRows(condition);
+    }
+
+    void deleteRows(const Condition& condition) {
+        int conditionIndex = condition.column;
+        IndexKey low = IndexKey::from(condition.value);
+        IndexKey high = IndexKey::from(condition.upper);
+        auto index = conditionIndex == -1 ? hashIndexes.end() : hashIndexes.find(conditionIndex);
+        if (condition.op == CompareOp::Equal && index != hashIndexes.end() && !index->second.count(condition.value)) {
+            cout << "Rows matching the condition were deleted.\n";
+            return;
+        }
+        if (layout == Layout::Columns) {
+            vector<bool> keep(rowCount);
+            int newRowCount = 0;
+            for (int i = 0; i < rowCount; ++i) {
+                keep[i] = conditionIndex != -1 && !condition.matches(columnData[conditionIndex].get(i), low, high);
+                newRowCount += keep[i];
+            }
+            for (Column& column : columnData) {
+                column.retain(keep);
+            }
+            rowCount = newRowCount;
+            rebuildIndexes();
+
+            cout << "Rows matching the condition were deleted.\n";
+            return;
+        }
+
         int newRowCount = 0;
         for (int i = 0; i < rowCount; ++i) {
-            if (conditionIndex == -1 || rows[i]->data[conditionIndex] == conditionVal) {
-                delete rows[i];
+            if (conditionIndex == -1 || condition.matches(rows[i]->data[conditionIndex], low, high)) {
+                freeRows.push_back(rows[i]);
             }
             else {
                 rows[newRowCount++] = rows[i];
             }
         }
         rowCount = newRowCount;
+        // Значения удалённых ячеек остаются в арене; когда их становится больше, чем живых,
+        // оставшиеся строки переносятся в новую арену
+        size_t liveBytes = 0;
+        for (int i = 0; i < rowCount; ++i) {
+            liveBytes += sizeof(Row) + sizeof(string_view) * rows[i]->size;
+            for (int j = 0; j < rows[i]->size; ++j) {
+                liveBytes += rows[i]->data[j].size();
+            }
+        }
+        if (arena.allocated() - liveBytes > liveBytes) {
+            Arena compacted;
+            for (int i = 0; i < rowCount; ++i) {
+                Row* row = compacted.allocateArray<Row>(1);
+                row->size = rows[i]->size;
+                row->data = compacted.allocateArray<string_view>(row->size);
+                for (int j = 0; j < row->size; ++j) {
+                    row->data[j] = compacted.copy(rows[i]->data[j]);
+                }
+                rows[i] = row;
+            }
+            freeRows.clear();
+            arena = move(compacted);
+        }
+        rebuildIndexes();
 
         cout << "Rows matching the condition were deleted.\n";
     }
+
+    void buildIndex(int column) {
+        unordered_map<string, vector<int>>& index = hashIndexes[column];
+        index.clear();
+        for (int i = 0; i < rowCount; ++i) {
+            index[string(cell(i, column))].push_back(i);
+        }
+    }
+
+    void buildOrderedIndex(int column) {
+        BPlusTree<IndexKey, int>& index = orderedIndexes[column];
+        index.clear();
+        for (int i = 0; i < rowCount; ++i) {
+            index.insert(IndexKey::from(cell(i, column)), i);
+        }
+    }
+
+    // Удаление сдвигает номера строк, поэтому индексы строятся заново
+    void rebuildIndexes() {
+        for (auto& entry : hashIndexes) {
+            buildIndex(entry.first);
+        }
+        for (auto& entry : orderedIndexes) {
+            buildOrderedIndex(entry.first);
+        }
+    }
+
+    // Номера строк под условием. Источник — хеш-индекс (равенство), B+дерево по столбцу условия,
+    // B+дерево по столбцу сортировки или полный просмотр. ordered = true, если строки уже
+    // идут по возрастанию orderColumn (равные — в порядке вставки), иначе — в порядке вставки.
+    vector<int> findRows(const Condition& condition, int orderColumn, bool& ordered) const {
+        vector<int> found;
+        ordered = false;
+        IndexKey low = IndexKey::from(condition.value);
+        IndexKey high = IndexKey::from(condition.upper);
+
+        auto hash = hashIndexes.find(condition.column);
+        if (condition.op == CompareOp::Equal && hash != hashIndexes.end()) {
+            auto match = hash->second.find(condition.value);
+            if (match != hash->second.end()) {
+                found = match->second;
+            }
+            return found;
+        }
+
+        auto accept = [&](const IndexKey&, int row) {
+            if (condition.column == -1 || condition.matches(cell(row, condition.column), low, high)) {
+                found.push_back(row);
+            }
+        };
+        auto tree = orderedIndexes.find(condition.column);
+        if (tree != orderedIndexes.end()) {
+            const IndexKey* from = &low;
+            const IndexKey* to = &low;
+            bool fromInclusive = true;
+            bool toInclusive = true;
+            if (condition.op == CompareOp::Less || condition.op == CompareOp::LessEqual) {
+                from = nullptr;
+                toInclusive = condition.op == CompareOp::LessEqual;
+            }
+            else if (condition.op == CompareOp::Greater || condition.op == CompareOp::GreaterEqual) {
+                to = nullptr;
+                fromInclusive = condition.op == CompareOp::GreaterEqual;
+            }
+            else if (condition.op == CompareOp::Between) {
+                to = &high;
+            }
+            tree->second.visitRange(from, fromInclusive, to, toInclusive, accept);
+            ordered = orderColumn == condition.column;
+            if (!ordered) {
+                // Без сортировки по этому столбцу строки выдаются в порядке вставки, как при просмотре
+                sort(found.begin(), found.end());
+            }
+            return found;
+        }
+
+        auto order = orderedIndexes.find(orderColumn);
+        if (order != orderedIndexes.end()) {
+            order->second.visitRange(nullptr, false, nullptr, false, accept);
+            ordered = true;
+            return found;
+        }
+
+        for (int i = 0; i < rowCount; ++i) {
+            accept(low, i);
+        }
+        return found;
+    }
 };
 
 struct Database {
     Table** tables;
     int tableCount;
     int capacity;
+    unordered_map<string, Table*> tableIndex; // имя таблицы -> таблица
 
     Database() : tableCount(0), capacity(10) {
         tables = new Table * [capacity];
@@ -158,12 +569,10 @@ struct Database {
         delete[] tables;
     }
 
-    void createTable(const string& name, const string* columns, int columnCount) {
-        for (int i = 0; i < tableCount; ++i) {
-            if (tables[i]->name == name) {
-                cerr << "Error: Table " << name << " already exists.\n";
-                return;
-            }
+    void createTable(const string& name, const string* columns, int columnCount, Layout layout = Layout::Rows) {
+        if (tableIndex.count(name)) {
+            cerr << "Error: Table " << name << " already exists.\n";
+            return;
         }
         if (tableCount == capacity) {
             capacity *= 2;
@@ -174,7 +583,8 @@ struct Database {
             delete[] tables;
             tables = newTables;
         }
-        tables[tableCount++] = new Table(name, columns, columnCount);
+        tables[tableCount] = new Table(name, columns, columnCount, layout);
+        tableIndex.emplace(name, tables[tableCount++]);
         cout << "Table " << name << " created with columns: ";
         for (int i = 0; i < columnCount; ++i) {
             cout << columns[i] << " ";
@@ -183,36 +593,22 @@ struct Database {
     }
 
     Table* getTable(const string& name) {
-        for (int i = 0; i < tableCount; ++i) {
-            if (tables[i]->name == name) {
-                return tables[i];
-            }
+        auto it = tableIndex.find(name);
+        if (it != tableIndex.end()) {
+            return it->second;
         }
         cerr << "Error: Table " << name << " not found.\n";
         return nullptr;
     }
 };
 
-bool tableExist(const string& tableName, Table** tables, int tableCount) {
-    for (int i = 0; i < tableCount; ++i) {
-        if (tables[i]->name == tableName) {
-            return true;
-        }
-    }
-    return false;
+bool tableExist(const string& tableName, const Database& db) {
+    return db.tableIndex.count(tableName) != 0;
 }
 
-bool columnExist(const string& tableName, const string& columnName, Table** tables, int tableCount) {
-    for (int i = 0; i < tableCount; ++i) {
-        if (tables[i]->name == tableName) {
-            for (int j = 0; j < tables[i]->columnCount; ++j) {
-                if (tables[i]->columns[j] == columnName) {
-                    return true;
-                }
-            }
-        }
-    }
-    return false;
+bool columnExist(const string& tableName, const string& columnName, const Database& db) {
+    auto it = db.tableIndex.find(tableName);
+    return it != db.tableIndex.end() && it->second->columnIndex(columnName) != -1;
 }
 
 void separateDot(const string& input, string& table, string& column) {
@@ -223,142 +619,549 @@ void separateDot(const string& input, string& table, string& column) {
     }
 }
 
-void select(string command, Database& db) {
-    regex selectPattern(R"(SELECT\s+(.+?)\s+FROM\s+(\w+)\s*(WHERE\s+(\w+)\s*=\s*(\w+|\".*?\"))?)");
-    smatch match;
+// Лексема запроса: слово (ключевое слово, имя или число), строка в кавычках или символ
+enum class TokenType {
+    Word,
+    String,
+    Symbol,
+    End
+};
 
-    if (regex_search(command, match, selectPattern)) {
-        string columnsStr = match[1].str();
-        string tableName = match[2].str();
-        string conditionCol = match[4].str();
-        string conditionVal = match[5].str();
+struct Token {
+    TokenType type;
+    string text;
+};
 
-        // Удаляем кавычки, если они есть
-        if (conditionVal.front() == '"' && conditionVal.back() == '"') {
-            conditionVal = conditionVal.substr(1, conditionVal.size() - 2);
+// Разбивает текст запроса на лексемы за один проход
+vector<Token> tokenize(const string& command) {
+    vector<Token> tokens;
+    size_t pos = 0;
+    while (pos < command.size()) {
+        char c = command[pos];
+        if (isspace(static_cast<unsigned char>(c))) {
+            ++pos;
         }
-
-        string* selectColumns = new string[10];
-        int selectCount = 0;
-        istringstream colStream(columnsStr);
-        string column;
-        while (getline(colStream, column, ',')) {
-            selectColumns[selectCount++] = column;
+        else if (isalnum(static_cast<unsigned char>(c)) || c == '_' || c == '.' || c == '*' || c == '-') {
+            size_t start = pos;
+            while (pos < command.size() && (isalnum(static_cast<unsigned char>(command[pos]))
+                || command[pos] == '_' || command[pos] == '.' || command[pos] == '*' || command[pos] == '-')) {
+                ++pos;
+            }
+            tokens.push_back({ TokenType::Word, command.substr(start, pos - start) });
         }
-
-        Table* table = db.getTable(tableName);
-        if (table) {
-            table->select(selectColumns, selectCount, conditionCol, conditionVal);
+        else if (c == '"') {
+            size_t close = command.find('"', pos + 1);
+            if (close == string::npos) {
+                close = command.size();
+            }
+            tokens.push_back({ TokenType::String, command.substr(pos + 1, close - pos - 1) });
+            pos = close + 1;
         }
         else {
-            cerr << "Error: Table " << tableName << " not found.\n";
+            tokens.push_back({ TokenType::Symbol, string(1, c) });
+            ++pos;
         }
-        delete[] selectColumns;
-    }
-    else {
-        cerr << "Invalid SELECT command.\n";
     }
+    tokens.push_back({ TokenType::End, "" });
+    return tokens;
 }
 
-void deleteRows(string command, Database& db) {
-    regex deletePattern(R"(DELETE\s+FROM\s+(\w+)\s+WHERE\s+(\w+)\s*=\s*(\w+|\".*?\"))");
-    smatch match;
+enum class StatementType {
+    Create,
+    CreateIndex,
+    Insert,
+    Select,
+    Delete,
+    Exit
+};
 
-    if (regex_search(command, match, deletePattern)) {
-        string tableName = match[1].str();
-        string conditionCol = match[2].str();
-        string conditionVal = match[3].str();
+// Разобранный запрос (AST). conditionCol пуст, если условия WHERE нет.
+struct Statement {
+    StatementType type;
+    string tableName;
+    vector<string> columns; // CREATE — столбцы таблицы, CREATE INDEX — столбец индекса, SELECT — выбираемые столбцы
+    vector<string> values;  // INSERT
+    Layout layout = Layout::Rows;          // CREATE
+    IndexType indexType = IndexType::Hash; // CREATE INDEX
+    string conditionCol;
+    CompareOp conditionOp = CompareOp::Equal;
+    string conditionVal;
+    string conditionUpper; // BETWEEN conditionVal AND conditionUpper
+    string orderBy;        // SELECT ... ORDER BY orderBy [DESC]
+    bool descending = false;
+    // параметры '?' по порядку: индекс в values, -1 для conditionVal, -2 для conditionUpper
+    vector<int> parameters;
+};
 
-        // Удаляем кавычки, если они есть
-        if (conditionVal.front() == '"' && conditionVal.back() == '"') {
-            conditionVal = conditionVal.substr(1, conditionVal.size() - 2);
-        }
+// Разбор рекурсивным спуском:
+//   CREATE [TABLE] t (col, ...) [COLUMNAR]
+//   CREATE INDEX ON t (col) [USING HASH | USING BTREE]
+//   INSERT [INTO] t [VALUES] (value, ...)
+//   SELECT col, ... FROM t [WHERE condition] [ORDER BY col [ASC | DESC]]
+//   DELETE FROM t WHERE condition
+//   EXIT
+// condition: col = value | col < value | col <= value | col > value | col >= value
+//   | col BETWEEN value AND value
+// Ключевые слова не зависят от регистра. Вместо значения можно указать параметр '?'.
+class Parser {
+public:
+    explicit Parser(const string& command) : tokens(tokenize(command)), pos(0) {
+    }
 
-        Table* table = db.getTable(tableName);
-        if (table) {
-            table->deleteRows(conditionCol, conditionVal);
+    bool parse(Statement& statement) {
+        if (acceptKeyword("CREATE")) {
+            if (acceptKeyword("INDEX")) {
+                statement.type = StatementType::CreateIndex;
+                if (!expectKeyword("ON") || !parseName(statement.tableName)
+                    || !parseList(statement, statement.columns, false)) {
+                    return false;
+                }
+                if (statement.columns.size() != 1) {
+                    error = "Syntax error: index must have exactly one column";
+                    return false;
+                }
+                if (acceptKeyword("USING")) {
+                    if (acceptKeyword("BTREE")) {
+                        statement.indexType = IndexType::BTree;
+                    }
+                    else if (!expectKeyword("HASH")) {
+                        return false;
+                    }
+                }
+                return parseEnd();
+            }
+            statement.type = StatementType::Create;
+            acceptKeyword("TABLE");
+            if (!parseName(statement.tableName) || !parseList(statement, statement.columns, false)) {
+                return false;
+            }
+            if (acceptKeyword("COLUMNAR")) {
+                statement.layout = Layout::Columns;
+            }
+            return parseEnd();
         }
-        else {
-            cerr << "Error: Table " << tableName << " not found.\n";
+        if (acceptKeyword("INSERT")) {
+            statement.type = StatementType::Insert;
+            acceptKeyword("INTO");
+            if (!parseName(statement.tableName)) {
+                return false;
+            }
+            acceptKeyword("VALUES");
+            return parseList(statement, statement.values, true) && parseEnd();
+        }
+        if (acceptKeyword("SELECT")) {
+            statement.type = StatementType::Select;
+            do {
+                string column;
+                if (!parseName(column)) {
+                    return false;
+                }
+                statement.columns.push_back(column);
+            } while (acceptSymbol(","));
+            if (!expectKeyword("FROM") || !parseName(statement.tableName) || !parseWhere(statement, false)) {
+                return false;
+            }
+            if (acceptKeyword("ORDER")) {
+                if (!expectKeyword("BY") || !parseName(statement.orderBy)) {
+                    return false;
+                }
+                if (acceptKeyword("DESC")) {
+                    statement.descending = true;
+                }
+                else {
+                    acceptKeyword("ASC");
+                }
+            }
+            return parseEnd();
+        }
+        if (acceptKeyword("DELETE")) {
+            statement.type = StatementType::Delete;
+            return expectKeyword("FROM") && parseName(statement.tableName)
+                && parseWhere(statement, true) && parseEnd();
+        }
+        if (acceptKeyword("EXIT")) {
+            statement.type = StatementType::Exit;
+            return parseEnd();
         }
+        error = "Unknown command: " + peek().text;
+        return false;
     }
-    else {
-        cerr << "Invalid DELETE command.\n";
+
+    const string& getError() const {
+        return error;
     }
-}
 
-void executeCommand(Database& db, const string& command) {
-    istringstream ss(command);
-    string action;
-    ss >> action;
+private:
+    vector<Token> tokens;
+    size_t pos;
+    string error;
+
+    const Token& peek() const {
+        return tokens[pos];
+    }
+
+    static bool equalsIgnoreCase(const string& a, const char* b) {
+        size_t i = 0;
+        for (; i < a.size() && b[i] != '\0'; ++i) {
+            if (toupper(static_cast<unsigned char>(a[i])) != b[i]) {
+                return false;
+            }
+        }
+        return i == a.size() && b[i] == '\0';
+    }
 
-    if (action == "CREATE") {
-        string tableName;
-        ss >> tableName;
+    bool acceptKeyword(const char* keyword) {
+        if (peek().type == TokenType::Word && equalsIgnoreCase(peek().text, keyword)) {
+            ++pos;
+            return true;
+        }
+        return false;
+    }
 
-        string columnsStr;
-        getline(ss, columnsStr, ')');
-        columnsStr = columnsStr.substr(columnsStr.find('(') + 1);
+    bool expectKeyword(const char* keyword) {
+        if (acceptKeyword(keyword)) {
+            return true;
+        }
+        error = string("Syntax error: expected ") + keyword + " but found '" + peek().text + "'";
+        return false;
+    }
 
-        string* columns = new string[10];
-        int columnCount = 0;
-        istringstream colStream(columnsStr);
-        string column;
-        while (getline(colStream, column, ',')) {
-            columns[columnCount++] = column;
+    bool acceptSymbol(const char* symbol) {
+        if (peek().type == TokenType::Symbol && peek().text == symbol) {
+            ++pos;
+            return true;
         }
+        return false;
+    }
 
-        db.createTable(tableName, columns, columnCount);
-        delete[] columns;
+    bool expectSymbol(const char* symbol) {
+        if (acceptSymbol(symbol)) {
+            return true;
+        }
+        error = string("Syntax error: expected '") + symbol + "' but found '" + peek().text + "'";
+        return false;
+    }
 
+    bool parseName(string& name) {
+        if (peek().type != TokenType::Word) {
+            error = "Syntax error: expected a name but found '" + peek().text + "'";
+            return false;
+        }
+        name = tokens[pos++].text;
+        return true;
+    }
+
+    // slot — куда подставляется параметр '?': индекс в values или -1 для условия
+    bool parseValue(Statement& statement, string& value, int slot) {
+        if (acceptSymbol("?")) {
+            value.clear();
+            statement.parameters.push_back(slot);
+            return true;
+        }
+        if (peek().type != TokenType::Word && peek().type != TokenType::String) {
+            error = "Syntax error: expected a value but found '" + peek().text + "'";
+            return false;
+        }
+        value = tokens[pos++].text;
+        return true;
     }
-    else if (action == "INSERT") {
-        string tableName;
-        ss >> tableName;
 
-        string valuesStr;
-        getline(ss, valuesStr, ')');
-        valuesStr = valuesStr.substr(valuesStr.find('(') + 1);
+    // (item, item, ...): имена столбцов или значения
+    bool parseList(Statement& statement, vector<string>& items, bool values) {
+        if (!expectSymbol("(")) {
+            return false;
+        }
+        do {
+            string item;
+            if (!(values ? parseValue(statement, item, static_cast<int>(items.size())) : parseName(item))) {
+                return false;
+            }
+            items.push_back(item);
+        } while (acceptSymbol(","));
+        return expectSymbol(")");
+    }
 
-        string* values = new string[10];
-        int valueCount = 0;
-        istringstream valueStream(valuesStr);
-        string value;
-        while (getline(valueStream, value, ',')) {
-            if (!value.empty() && value.front() == '"' && value.back() == '"') {
-                value = value.substr(1, value.size() - 2);
+    bool parseWhere(Statement& statement, bool required) {
+        if (!acceptKeyword("WHERE")) {
+            if (required) {
+                error = "Syntax error: expected WHERE but found '" + peek().text + "'";
             }
-            values[valueCount++] = value;
+            return !required;
+        }
+        if (!parseName(statement.conditionCol)) {
+            return false;
+        }
+        if (acceptKeyword("BETWEEN")) {
+            statement.conditionOp = CompareOp::Between;
+            return parseValue(statement, statement.conditionVal, -1) && expectKeyword("AND")
+                && parseValue(statement, statement.conditionUpper, -2);
+        }
+        if (acceptSymbol("<")) {
+            statement.conditionOp = acceptSymbol("=") ? CompareOp::LessEqual : CompareOp::Less;
+        }
+        else if (acceptSymbol(">")) {
+            statement.conditionOp = acceptSymbol("=") ? CompareOp::GreaterEqual : CompareOp::Greater;
+        }
+        else if (!acceptSymbol("=")) {
+            error = "Syntax error: expected comparison operator but found '" + peek().text + "'";
+            return false;
+        }
+        return parseValue(statement, statement.conditionVal, -1);
+    }
+
+    bool parseEnd() {
+        acceptSymbol(";");
+        if (peek().type != TokenType::End) {
+            error = "Syntax error: unexpected '" + peek().text + "'";
+            return false;
         }
+        return true;
+    }
+};
 
-        Table* table = db.getTable(tableName);
+// CREATE, CREATE INDEX и EXIT; INSERT, SELECT и DELETE выполняет PreparedStatement
+void executeStatement(Database& db, const Statement& statement) {
+    if (statement.type == StatementType::Create) {
+        db.createTable(statement.tableName, statement.columns.data(), static_cast<int>(statement.columns.size()), statement.layout);
+    }
+    else if (statement.type == StatementType::CreateIndex) {
+        Table* table = db.getTable(statement.tableName);
         if (table) {
-            table->insertRow(values, valueCount);
+            table->createIndex(statement.columns[0], statement.indexType);
+        }
+    }
+    else if (statement.type == StatementType::Exit) {
+        exit(0);
+    }
+}
+
+// Подготовленный запрос: разбор, поиск таблицы и номеров столбцов выполняются один раз
+// в prepare, execute только подставляет значения параметров '?'
+class PreparedStatement {
+public:
+    size_t parameterCount() const {
+        return statement.parameters.size();
+    }
+
+    // Параметры нумеруются с 1 в порядке появления '?' в тексте запроса
+    bool bind(size_t index, const string& value) {
+        if (index == 0 || index > statement.parameters.size()) {
+            cerr << "Error: Parameter index " << index << " out of range.\n";
+            return false;
+        }
+        int slot = statement.parameters[index - 1];
+        if (slot == -1) {
+            condition.value = value;
+        }
+        else if (slot == -2) {
+            condition.upper = value;
         }
         else {
-            cerr << "Error: Table " << tableName << " not found.\n";
+            statement.values[slot] = value;
         }
-        delete[] values;
+        bound[index - 1] = true;
+        return true;
+    }
 
+    bool bind(size_t index, int value) {
+        return bind(index, to_string(value));
     }
-    else if (action == "SELECT") {
-        select(command, db);
 
+    void execute() {
+        StreamSink sink(cout);
+        execute(sink);
     }
-    else if (action == "DELETE") {
-        deleteRows(command, db);
 
+    void execute(ResultSink& sink) {
+        for (size_t i = 0; i < bound.size(); ++i) {
+            if (!bound[i]) {
+                cerr << "Error: Parameter " << i + 1 << " is not bound.\n";
+                return;
+            }
+        }
+
+        if (statement.type == StatementType::Insert) {
+            table->insertRow(statement.values.data(), static_cast<int>(statement.values.size()));
+        }
+        else if (statement.type == StatementType::Select) {
+            table->select(selectIndices.data(), static_cast<int>(selectIndices.size()), condition, orderColumn, statement.descending, sink);
+        }
+        else if (statement.type == StatementType::Delete) {
+            table->deleteRows(condition);
+        }
+        else {
+            executeStatement(*db, statement);
+        }
     }
-    else if (action == "EXIT") {
-        exit(0);
+
+private:
+    friend bool prepare(Database& db, Statement statement, PreparedStatement& prepared);
+
+    Database* db = nullptr;
+    Statement statement;
+    Table* table = nullptr;
+    vector<int> selectIndices;
+    Condition condition;
+    int orderColumn = -1;
+    vector<bool> bound;
+};
+
+bool prepare(Database& db, Statement statement, PreparedStatement& prepared) {
+    Table* table = nullptr;
+    vector<int> selectIndices;
+    Condition condition;
+    int orderColumn = -1;
+    if (statement.type == StatementType::Insert || statement.type == StatementType::Select
+        || statement.type == StatementType::Delete) {
+        table = db.getTable(statement.tableName);
+        if (!table) {
+            return false;
+        }
     }
-    else {
-        cerr << "Unknown command: " << action << endl;
+    if (statement.type == StatementType::Insert && static_cast<int>(statement.values.size()) != table->columnCount) {
+        cerr << "Error: Number of values does not match number of columns.\n";
+        return false;
     }
+    if (statement.type == StatementType::Select) {
+        for (const string& column : statement.columns) {
+            selectIndices.push_back(table->columnIndex(column));
+            if (selectIndices.back() == -1) {
+                cerr << "Error: Column " << column << " not found.\n";
+                return false;
+            }
+        }
+    }
+    if (!statement.conditionCol.empty()) {
+        condition.column = table->columnIndex(statement.conditionCol);
+        if (condition.column == -1) {
+            cerr << "Error: Condition column " << statement.conditionCol << " not found.\n";
+            return false;
+        }
+        condition.op = statement.conditionOp;
+        condition.value = statement.conditionVal;
+        condition.upper = statement.conditionUpper;
+    }
+    if (!statement.orderBy.empty()) {
+        orderColumn = table->columnIndex(statement.orderBy);
+        if (orderColumn == -1) {
+            cerr << "Error: Column " << statement.orderBy << " not found.\n";
+            return false;
+        }
+    }
+
+    prepared.db = &db;
+    prepared.table = table;
+    prepared.selectIndices = move(selectIndices);
+    prepared.condition = move(condition);
+    prepared.orderColumn = orderColumn;
+    prepared.bound.assign(statement.parameters.size(), false);
+    prepared.statement = move(statement);
+    return true;
+}
+
+bool prepare(Database& db, const string& command, PreparedStatement& prepared) {
+    Parser parser(command);
+    Statement statement;
+    if (!parser.parse(statement)) {
+        cerr << parser.getError() << endl;
+        return false;
+    }
+    return prepare(db, move(statement), prepared);
+}
+
+void executeCommand(Database& db, const string& command) {
+    Parser parser(command);
+    Statement statement;
+    if (!parser.parse(statement)) {
+        cerr << parser.getError() << endl;
+        return;
+    }
+    if (!statement.parameters.empty()) {
+        cerr << "Error: Parameters '?' are only allowed in prepared statements.\n";
+        return;
+    }
+    PreparedStatement prepared;
+    if (prepare(db, move(statement), prepared)) {
+        prepared.execute();
+    }
+}
+
+// Замеры производительности (режим --bench); время выводится в наносекундах на оператор
+
+// Разбор SELECT/DELETE: Parser против прежнего пути, который строил std::regex при каждом вызове.
+// Путь с regex медленнее на два порядка и замеряется на меньшем числе операторов.
+void benchParser(int iterations, int regexIterations) {
+    const vector<string> commands = {
+        "SELECT name, age FROM users WHERE age = 30",
+        "SELECT * FROM users",
+        "DELETE FROM users WHERE name = \"Bob\"",
+        "SELECT id FROM orders WHERE total = 100",
+    };
+
+    auto start = chrono::steady_clock::now();
+    size_t matched = 0;
+    for (int i = 0; i < regexIterations; ++i) {
+        const string& command = commands[i % commands.size()];
+        smatch match;
+        if (command.compare(0, 6, "SELECT") == 0) {
+            regex selectPattern(R"(SELECT\s+(.+?)\s+FROM\s+(\w+)\s*(WHERE\s+(\w+)\s*=\s*(\w+|\".*?\"))?)");
+            matched += regex_search(command, match, selectPattern);
+        }
+        else {
+            regex deletePattern(R"(DELETE\s+FROM\s+(\w+)\s+WHERE\s+(\w+)\s*=\s*(\w+|\".*?\"))");
+            matched += regex_search(command, match, deletePattern);
+        }
+    }
+    double regexNs = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / regexIterations;
+
+    start = chrono::steady_clock::now();
+    size_t parsed = 0;
+    for (int i = 0; i < iterations; ++i) {
+        Parser parser(commands[i % commands.size()]);
+        Statement statement;
+        parsed += parser.parse(statement);
+    }
+    double parserNs = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / iterations;
+
+    cout << "parse: regex " << regexNs << " ns/st (" << matched << " of " << regexIterations << " matched), parser "
+        << parserNs << " ns/st (" << parsed << " of " << iterations << " parsed)\n";
+}
+
+// INSERT в последнюю из tableCount таблиц: поиск таблицы и столбцов по имени не должен
+// зависеть от числа таблиц
+void benchTableLookup(int tableCount, int inserts) {
+    Database db;
+    const string columns[] = { "id", "name", "age", "city" };
+    streambuf* output = cout.rdbuf(nullptr); // сообщения о создании таблиц не выводятся
+    for (int i = 0; i < tableCount; ++i) {
+        db.createTable("t" + to_string(i), columns, 4);
+    }
+    cout.rdbuf(output);
+
+    const string command = "INSERT INTO t" + to_string(tableCount - 1) + " VALUES (1, Alice, 30, Paris)";
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < inserts; ++i) {
+        executeCommand(db, command);
+    }
+    double ns = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / inserts;
+
+    cout << "insert into the last of " << tableCount << " tables: " << ns << " ns/st\n";
 }
 
-int main() {
+void runBenchmarks() {
+    benchParser(200000, 2000);
+    for (int tableCount : { 10, 100, 1000, 10000 }) {
+        benchTableLookup(tableCount, 200000);
+    }
+}
+
+int main(int argc, char* argv[]) {
     setlocale(LC_ALL, "RUSSIAN");
+    if (argc > 1 && string(argv[1]) == "--bench") {
+        runBenchmarks();
+        return 0;
+    }
+
     Database db;
     string command;
 
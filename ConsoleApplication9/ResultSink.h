@@ -0,0 +1,129 @@
+﻿#pragma once
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <functional>
+#include <stdexcept>
+
+// Приёмник строк результата запроса. Строки передаются без завершающего перевода строки.
+// Реализации не потокобезопасны: при параллельном выводе вызывающий код сериализует вызовы.
+class ResultSink {
+public:
+    virtual ~ResultSink() = default;
+
+    virtual void writeRow(std::string_view row) = 0;
+
+    // Несколько строк, каждая завершена '\n'
+    virtual void writeRows(std::string_view rows) {
+        size_t start = 0;
+        while (start < rows.size()) {
+            size_t end = rows.find('\n', start);
+            if (end == std::string_view::npos) {
+                end = rows.size();
+            }
+            writeRow(rows.substr(start, end - start));
+            start = end + 1;
+        }
+    }
+
+    // Точка сброса: вызывается в конце каждого запроса
+    virtual void flush() {
+    }
+};
+
+// Буферизованный вывод в поток: в поток пишется крупными порциями, а не построчно
+class StreamSink : public ResultSink {
+public:
+    explicit StreamSink(std::ostream& out = std::cout, size_t bufferSize = 1 << 16)
+        : out(out), bufferSize(bufferSize) {
+        buffer.reserve(bufferSize);
+    }
+
+    ~StreamSink() override {
+        flush();
+    }
+
+    void writeRow(std::string_view row) override {
+        buffer.append(row).push_back('\n');
+        if (buffer.size() >= bufferSize) {
+            drain();
+        }
+    }
+
+    void writeRows(std::string_view rows) override {
+        buffer.append(rows);
+        if (buffer.size() >= bufferSize) {
+            drain();
+        }
+    }
+
+    void flush() override {
+        drain();
+        out.flush();
+    }
+
+private:
+    std::ostream& out;
+    size_t bufferSize;
+    std::string buffer;
+
+    void drain() {
+        out.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+        buffer.clear();
+    }
+};
+
+// Буферизованная запись результата в файл
+class FileSink : public ResultSink {
+public:
+    explicit FileSink(const std::string& fileName, size_t bufferSize = 1 << 20)
+        : file(fileName, std::ios::binary | std::ios::trunc), stream(file, bufferSize) {
+        if (!file.is_open()) {
+            throw std::runtime_error("Could not open output file: " + fileName);
+        }
+    }
+
+    void writeRow(std::string_view row) override {
+        stream.writeRow(row);
+    }
+
+    void writeRows(std::string_view rows) override {
+        stream.writeRows(rows);
+    }
+
+    void flush() override {
+        stream.flush();
+    }
+
+private:
+    std::ofstream file;
+    StreamSink stream;
+};
+
+// Сбор результата в память
+class VectorSink : public ResultSink {
+public:
+    std::vector<std::string> rows;
+
+    void writeRow(std::string_view row) override {
+        rows.emplace_back(row);
+    }
+};
+
+// Передача каждой строки в пользовательскую функцию
+class CallbackSink : public ResultSink {
+public:
+    explicit CallbackSink(std::function<void(std::string_view)> callback)
+        : callback(std::move(callback)) {
+    }
+
+    void writeRow(std::string_view row) override {
+        callback(row);
+    }
+
+private:
+    std::function<void(std::string_view)> callback;
+};